@@ -0,0 +1,126 @@
+"""Checks that streamed downloads persist every security.
+
+Runs ibdq with --stream against the local quote server, on a book larger
+than one read-ahead window, where requests are served without a transfer -
+from a warm --cache-ttl cache, and from a --resume journal left by a killed
+run - and fails unless every security gets a price, and the journal is
+cleared once the book commits.
+"""
+import argparse
+import os
+import shlex
+import shutil
+import sqlite3
+import subprocess
+import sys
+import tempfile
+import time
+
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+CHECKPOINT_FILE = 'ibdq-checkpoint.sqlite'
+
+
+def start_server(args):
+    # Killed runs leave the server writing to closed connections, so its errors are not shown
+    command = [sys.executable, os.path.join(BENCH_DIR, 'quote_server.py'), '--latency-ms', str(args.latency_ms)]
+    server = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True)
+    port = int(server.stdout.readline().split()[-1])
+
+    return server, port
+
+
+def priced_securities(data_dir):
+    with sqlite3.connect(os.path.join(data_dir, 'accountsData.ibank')) as db:
+        return db.execute('SELECT COUNT(DISTINCT zsecurityid) FROM zprice').fetchone()[0]
+
+
+def completed_downloads(data_dir):
+    try:
+        with sqlite3.connect(os.path.join(data_dir, CHECKPOINT_FILE), timeout=1) as db:
+            return db.execute('SELECT COUNT(*) FROM checkpoint_download').fetchone()[0]
+    except sqlite3.Error:
+        return 0
+
+
+def ibdq_command(args, price_url, flags, data_dir):
+    return [args.ibdq, '--price-url', price_url] + flags + shlex.split(args.ibdq_args) + [data_dir]
+
+
+def run(args, price_url, flags, data_dir):
+    return subprocess.run(ibdq_command(args, price_url, flags, data_dir),
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL).returncode
+
+
+def check(name, status, data_dir, securities):
+    priced = priced_securities(data_dir)
+    ok = status == 0 and priced == securities
+    print(f'{"ok" if ok else "FAILED"}: {name} - exit {status}, {priced} of {securities} securities priced')
+
+    return ok
+
+
+def check_cache(args, price_url, data_dir, securities):
+    flags = ['--stream', '--cache-ttl', '3600']
+    run(args, price_url, flags, data_dir)
+    with sqlite3.connect(os.path.join(data_dir, 'accountsData.ibank')) as db:
+        db.execute('DELETE FROM zprice')
+
+    return check('served from the cache', run(args, price_url, flags, data_dir), data_dir, securities)
+
+
+def check_resume(args, price_url, data_dir, securities):
+    flags = ['--stream', '--resume']
+    process = subprocess.Popen(ibdq_command(args, price_url, flags, data_dir),
+                               stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    # Killed once more downloads are journaled than one read-ahead window holds
+    while process.poll() is None and completed_downloads(data_dir) < args.kill_after:
+        time.sleep(0.05)
+    if process.poll() is not None:
+        print(f'FAILED: resumed from the journal - finished before {args.kill_after} downloads were journaled')
+        return False
+    process.kill()
+    process.wait()
+
+    ok = check('resumed from the journal', run(args, price_url, flags, data_dir), data_dir, securities)
+    if ok and completed_downloads(data_dir) != 0:
+        print('FAILED: resumed from the journal - journal not cleared')
+        ok = False
+
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--ibdq', required=True, help='path to the ibdq executable')
+    parser.add_argument('--ibdq-args', default='--epoll', help='extra ibdq arguments (default: --epoll)')
+    parser.add_argument('--securities', type=int, default=300, help='number of securities in the book')
+    parser.add_argument('--kill-after', type=int, default=40, help='downloads journaled before killing a run')
+    parser.add_argument('--latency-ms', type=float, default=50, help='mean quote server latency')
+    args = parser.parse_args()
+
+    work_dir = tempfile.mkdtemp(prefix='ibdq-check-')
+    template_dir = os.path.join(work_dir, 'template')
+    server, port = start_server(args)
+    price_url = f'http://127.0.0.1:{port}/download/%s?interval=1d&events=history'
+    results = []
+    try:
+        subprocess.run(
+            [sys.executable, os.path.join(BENCH_DIR, 'make_book.py'), template_dir,
+             '--securities', str(args.securities)],
+            check=True
+        )
+        for name, check_fn in (('cache', check_cache), ('resume', check_resume)):
+            data_dir = os.path.join(work_dir, name)
+            shutil.copytree(template_dir, data_dir)
+            results.append(check_fn(args, price_url, data_dir, args.securities))
+    finally:
+        server.terminate()
+        server.wait()
+        shutil.rmtree(work_dir, ignore_errors=True)
+
+    return 0 if all(results) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
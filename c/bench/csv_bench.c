@@ -0,0 +1,387 @@
+/**
+ * Microbenchmark for the price CSV tokenizer.
+ *
+ * Compares the byte-at-a-time state machine ibdq used to parse downloads
+ * with the span tokenizer that finds delimiters with csv_scan, using both
+ * the scalar and the vectorized scan, and with the table-driven parser in
+ * price_csv, over a synthetic price history.
+ *
+ * Then checks price_csv gives the same rows however the history is split
+ * into chunks (down to a byte at a time), with its columns reordered, with an
+ * extra column, and without Adj Close - exiting with failure if not.
+ *
+ * With --check, as run by ctest, each parser runs once over a shorter
+ * history, without timings, and any that finds other rows than the bytewise
+ * state machine fails the check.
+ *
+ * Usage: csv_bench [rows] [iterations]
+ *        csv_bench --check [rows]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "csv_scan.h"
+#include "price_csv.h"
+
+#define CSV_HEADER "Date,Open,High,Low,Close,Adj Close,Volume"
+#define MAX_NUM_LEN 19
+#define DEFAULT_ROWS 100000
+#define DEFAULT_ITERATIONS 20
+#define CHECK_ARG "--check"
+#define CHECK_ROWS 10000
+#define EXTRA_COLUMN -1
+#define EXTRA_COLUMN_NAME "Dividends"
+#define EXTRA_COLUMN_VALUE "0.25"
+#define RANDOM_SPLITS 8
+
+typedef const char *(*scan_fn)(const char *p, const char *end);
+
+typedef struct totals {
+    long rows;
+    long long volume;
+    unsigned long checksum;
+} totals;
+
+static double now_secs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1.0e9;
+}
+
+// Synthetic history in the format served by Yahoo Finance (and bench/quote_server.py)
+static char *make_csv(long rows, size_t *len) {
+    size_t capacity = sizeof(CSV_HEADER) + rows * 96;
+    char *body = malloc(capacity);
+    double price = 100;
+    size_t n = snprintf(body, capacity, "%s", CSV_HEADER);
+
+    srand(42);
+    for (long row = 0; row < rows; row++) {
+        double open = price, close = price * (0.97 + rand() % 600 / 10000.0);
+        double high = (open > close ? open : close) * 1.005, low = (open < close ? open : close) * 0.995;
+        n += snprintf(body + n, capacity - n, "\n%04ld-%02ld-%02ld,%.6f,%.6f,%.6f,%.6f,%.6f,%d",
+                      1990 + row / 366 % 100, 1 + row / 31 % 12, 1 + row % 28,
+                      open, high, low, close, close, 1000 + rand() % 50000000);
+        price = close;
+    }
+    *len = n;
+
+    return body;
+}
+
+static int is_num_char(char c) {
+    return c == '.' || (c >= '0' && c <= '9');
+}
+
+static void add_field(totals *t, const char *field, int len) {
+    for (int i = 0; i < len; i++) t->checksum = t->checksum * 31 + field[i];
+}
+
+// Previous parser - one pass through the state machine per byte
+static int parse_bytewise(const char *body, size_t len, totals *t) {
+    enum { HEADER, DATE, OPEN, HIGH, LOW, CLOSE, ADJCLOSE, VOLUME } state = HEADER;
+    char field[MAX_NUM_LEN + 1];
+    int header_pos = 0, field_len = 0, date = 0;
+    long long volume = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = body[i];
+        if (state == HEADER) {
+            if (header_pos == sizeof(CSV_HEADER) - 1 && c == '\n') {
+                state = DATE;
+            } else if (header_pos < sizeof(CSV_HEADER) - 1 && c == CSV_HEADER[header_pos]) {
+                header_pos++;
+            } else {
+                return -1;
+            }
+        } else if (state == DATE) {
+            if (c == ',') {
+                t->checksum = t->checksum * 31 + date;
+                date = 0;
+                state = OPEN;
+            } else if (c == '-' || (c >= '0' && c <= '9')) {
+                date = c == '-' ? date : date * 10 + c - '0';
+            } else {
+                return -1;
+            }
+        } else if (state < ADJCLOSE) {
+            if (c == ',') {
+                add_field(t, field, field_len);
+                field_len = 0;
+                state++;
+            } else if (field_len < MAX_NUM_LEN && is_num_char(c)) {
+                field[field_len++] = c;
+            } else {
+                return -1;
+            }
+        } else if (state == ADJCLOSE) {
+            if (c == ',') state = VOLUME;
+        } else {
+            if (c == '\n') {
+                t->volume += volume;
+                t->rows++;
+                volume = 0;
+                state = DATE;
+            } else if (c >= '0' && c <= '9') {
+                volume = volume * 10 + c - '0';
+            } else {
+                return -1;
+            }
+        }
+    }
+    if (state == VOLUME) {
+        t->volume += volume;
+        t->rows++;
+    }
+
+    return 0;
+}
+
+// Span tokenizer - each field is delimited with one scan, then copied in bulk
+static int parse_spans(const char *body, size_t len, scan_fn scan, totals *t) {
+    const char *p = body, *end = body + len;
+
+    if (len < sizeof(CSV_HEADER) || memcmp(body, CSV_HEADER, sizeof(CSV_HEADER) - 1) != 0) {
+        return -1;
+    }
+    p += sizeof(CSV_HEADER) - 1;
+    while (p < end && *p == '\n') {
+        int date = 0;
+        long long volume = 0;
+        const char *delim;
+
+        for (p++; p < end && *p != ','; p++) {
+            if (*p >= '0' && *p <= '9') date = date * 10 + *p - '0';
+            else if (*p != '-') return -1;
+        }
+        if (p == end) break;
+        t->checksum = t->checksum * 31 + date;
+        for (int field = 0; field < 4; field++) {
+            char buf[MAX_NUM_LEN + 1];
+            int field_len;
+
+            delim = scan(++p, end);
+            if (delim == end || *delim != ',' || (field_len = (int)(delim - p)) > MAX_NUM_LEN) return -1;
+            for (int i = 0; i < field_len; i++) {
+                if (!is_num_char(p[i])) return -1;
+            }
+            memcpy(buf, p, field_len);
+            add_field(t, buf, field_len);
+            p = delim;
+        }
+        delim = scan(++p, end);
+        if (delim == end) return -1;
+        for (p = delim + 1, delim = scan(p, end); p < delim; p++) {
+            if (*p < '0' || *p > '9') return -1;
+            volume = volume * 10 + *p - '0';
+        }
+        t->volume += volume;
+        t->rows++;
+    }
+
+    return 0;
+}
+
+// Adds a price as its characters, as the tokenizers above do
+static void add_decimal(totals *t, const price_decimal *decimal) {
+    char digits[MAX_NUM_LEN + 1], field[MAX_NUM_LEN + 1];
+    int64_t units = decimal->units;
+    int n = 0, len = 0;
+
+    do {
+        digits[n++] = (char)('0' + units % 10);
+        units /= 10;
+    } while (units > 0 || n <= decimal->scale);
+    while (n-- > 0) {
+        field[len++] = digits[n];
+        if (decimal->point && n == decimal->scale) field[len++] = '.';
+    }
+    add_field(t, field, len);
+}
+
+static bool add_row(void *ctx, price_row *row) {
+    totals *t = (totals*)ctx;
+
+    t->checksum = t->checksum * 31 + (row->date.tm_year + 1900) * 10000 + (row->date.tm_mon + 1) * 100 + row->date.tm_mday;
+    add_decimal(t, &row->open);
+    add_decimal(t, &row->high);
+    add_decimal(t, &row->low);
+    add_decimal(t, &row->close);
+    t->volume += row->volume;
+    t->rows++;
+
+    return true;
+}
+
+// Counts rows only - price_csv has already converted each field
+static bool count_row(void *ctx, price_row *row) {
+    totals *t = (totals*)ctx;
+
+    t->volume += row->volume;
+    t->rows++;
+
+    return true;
+}
+
+// Table-driven parser, fed chunks of at most chunk bytes (or random sizes up to
+// chunk, when random), as they would arrive from a download
+static int parse_table(const char *body, size_t len, size_t chunk, bool random, price_csv_row_fn on_row, totals *t) {
+    price_csv csv;
+
+    price_csv_init(&csv);
+    for (size_t i = 0; i < len; ) {
+        size_t n = random ? 1 + (size_t)rand() % chunk : chunk;
+        if (n > len - i) n = len - i;
+        if (price_csv_parse(&csv, body + i, n, on_row, t) != PRICE_CSV_MORE) {
+            return -1;
+        }
+        i += n;
+    }
+
+    return price_csv_finish(&csv, on_row, t) ? 0 : -1;
+}
+
+// Rebuilds the synthetic history with the columns in order - indexes of its
+// columns, or EXTRA_COLUMN
+static char *make_layout(const char *body, size_t len, const int *order, int columns, size_t *layout_len) {
+    char *layout = malloc(len * 2);
+    const char *line = body, *end = body + len;
+    size_t n = 0;
+
+    while (line < end) {
+        const char *fields[8], *eol = memchr(line, '\n', end - line);
+        int field_lens[8], count = 0;
+
+        if (eol == NULL) eol = end;
+        for (const char *p = line; count < 8; count++) {
+            const char *delim = memchr(p, ',', eol - p);
+            fields[count] = p;
+            field_lens[count] = (int)((delim ? delim : eol) - p);
+            if (delim == NULL) {
+                count++;
+                break;
+            }
+            p = delim + 1;
+        }
+        for (int i = 0; i < columns; i++) {
+            if (i > 0) layout[n++] = ',';
+            if (order[i] == EXTRA_COLUMN) {
+                const char *extra = line == body ? EXTRA_COLUMN_NAME : EXTRA_COLUMN_VALUE;
+                memcpy(layout + n, extra, strlen(extra));
+                n += strlen(extra);
+            } else if (order[i] < count) {
+                memcpy(layout + n, fields[order[i]], field_lens[order[i]]);
+                n += field_lens[order[i]];
+            }
+        }
+        if (eol < end) layout[n++] = '\n';
+        line = eol + 1;
+    }
+    *layout_len = n;
+
+    return layout;
+}
+
+static bool same_totals(const totals *a, const totals *b) {
+    return a->rows == b->rows && a->volume == b->volume && a->checksum == b->checksum;
+}
+
+// Prints the throughput of a parser, or only whether it found the expected
+// rows when checking, returning nonzero if not
+static int report(const char *name, double secs, size_t bytes, int iterations, bool check,
+                  const totals *t, const totals *expected) {
+    bool mismatch = expected && !same_totals(t, expected);
+
+    if (check) {
+        printf("%-24s %s\n", name, mismatch ? "MISMATCH" : "ok");
+    } else {
+        printf("%-24s %8.1f MB/s %8.2f ns/row%s\n", name,
+               bytes * (double)iterations / secs / 1.0e6,
+               secs * 1.0e9 / (t->rows ? t->rows : 1),
+               mismatch ? "  MISMATCH" : "");
+    }
+
+    return mismatch;
+}
+
+// Parses each layout of the history whole, a byte at a time, in odd and random
+// chunks, expecting the rows found by the bytewise state machine every time
+static int check_chunk_splits(const char *body, size_t len) {
+    static const struct { const char *name; int order[8]; int columns; } layouts[] = {
+        { "as downloaded", { 0, 1, 2, 3, 4, 5, 6 }, 7 },
+        { "reordered", { 6, 4, 0, 3, 5, 2, 1 }, 7 },
+        { "extra column", { 0, 1, 2, 3, 4, 5, 6, EXTRA_COLUMN }, 8 },
+        { "no Adj Close", { 0, 1, 2, 3, 4, 6 }, 6 },
+    };
+    static const size_t chunks[] = { 1, 7, 64, 1000 };
+    totals expected = { 0 };
+    int failed = parse_bytewise(body, len, &expected);
+
+    for (int l = 0; l < (int)(sizeof(layouts) / sizeof(layouts[0])); l++) {
+        size_t layout_len;
+        char *layout = make_layout(body, len, layouts[l].order, layouts[l].columns, &layout_len);
+        int mismatches = 0;
+
+        for (int c = 0; c < (int)(sizeof(chunks) / sizeof(chunks[0])); c++) {
+            totals split = { 0 };
+            if (parse_table(layout, layout_len, chunks[c], false, add_row, &split) != 0 || !same_totals(&split, &expected)) {
+                mismatches++;
+            }
+        }
+        srand(l);
+        for (int r = 0; r < RANDOM_SPLITS; r++) {
+            totals split = { 0 };
+            if (parse_table(layout, layout_len, 1 + r * 37, true, add_row, &split) != 0 || !same_totals(&split, &expected)) {
+                mismatches++;
+            }
+        }
+        printf("chunk splits, %-14s %s\n", layouts[l].name, mismatches ? "MISMATCH" : "ok");
+        failed |= mismatches;
+        free(layout);
+    }
+
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    bool check = argc > 1 && strcmp(argv[1], CHECK_ARG) == 0;
+    int arg = check ? 2 : 1;
+    long rows = argc > arg ? atol(argv[arg]) : check ? CHECK_ROWS : DEFAULT_ROWS;
+    int iterations = check ? 1 : argc > arg + 1 ? atoi(argv[arg + 1]) : DEFAULT_ITERATIONS;
+    size_t len;
+    char *body = make_csv(rows, &len);
+    totals bytewise = { 0 }, scalar = { 0 }, vectorized = { 0 }, table = { 0 };
+    double start;
+    int failed = 0;
+
+    printf("%ld rows, %.1f MB, %d iterations, %s scan\n", rows, len / 1.0e6, iterations, csv_scan_isa());
+
+    start = now_secs();
+    for (int i = 0; i < iterations; i++) failed |= parse_bytewise(body, len, &bytewise);
+    failed |= report("bytewise state machine", now_secs() - start, len, iterations, check, &bytewise, NULL);
+
+    start = now_secs();
+    for (int i = 0; i < iterations; i++) failed |= parse_spans(body, len, csv_scan_delim_scalar, &scalar);
+    failed |= report("spans, scalar scan", now_secs() - start, len, iterations, check, &scalar, &bytewise);
+
+    start = now_secs();
+    for (int i = 0; i < iterations; i++) failed |= parse_spans(body, len, csv_scan_delim, &vectorized);
+    failed |= report("spans, vectorized scan", now_secs() - start, len, iterations, check, &vectorized, &bytewise);
+
+    // Timed converting fields only, but checked against every field
+    start = now_secs();
+    for (int i = 0; i < iterations; i++) failed |= parse_table(body, len, len, false, check ? add_row : count_row, &table);
+    failed |= report("table-driven parser", now_secs() - start, len, iterations, check, &table, check ? &bytewise : NULL);
+
+    failed |= check_chunk_splits(body, len);
+    free(body);
+    if (failed) {
+        fprintf(stderr, "Failed to parse synthetic CSV.\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+"""Generates a synthetic Banktivity data directory for benchmarking.
+
+Creates <dir>/accountsData.ibank with N securities in zsecurity, and
+optionally some existing prices in zprice, using the subset of the Core
+Data schema that ibdq reads and writes.
+"""
+import argparse
+import datetime
+import os
+import sqlite3
+import sys
+import uuid
+
+
+ENT = 42
+OPT = 1
+IBANK_EPOCH = 978292800
+
+SCHEMA = '''
+CREATE TABLE zsecurity (
+    z_pk INTEGER PRIMARY KEY, z_ent INTEGER, z_opt INTEGER,
+    zuniqueid VARCHAR, zsymbol VARCHAR, zname VARCHAR
+);
+CREATE TABLE zprice (
+    z_pk INTEGER PRIMARY KEY, z_ent INTEGER, z_opt INTEGER,
+    zdate TIMESTAMP, zsecurityid VARCHAR,
+    zvolume INTEGER, zclosingprice DECIMAL, zhighprice DECIMAL,
+    zlowprice DECIMAL, zopeningprice DECIMAL
+);
+CREATE TABLE z_primarykey (
+    z_ent INTEGER PRIMARY KEY, z_name VARCHAR, z_super INTEGER, z_max INTEGER
+);
+'''
+
+
+def symbol_for(index):
+    letters = ''
+    index += 1
+    while index:
+        index, rem = divmod(index - 1, 26)
+        letters = chr(ord('A') + rem) + letters
+
+    return letters
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('data_dir', help='directory to create accountsData.ibank in')
+    parser.add_argument('--securities', type=int, default=1000, help='number of securities')
+    parser.add_argument('--price-days', type=int, default=0, help='days of existing prices per security')
+    args = parser.parse_args()
+
+    os.makedirs(args.data_dir, exist_ok=True)
+    path = os.path.join(args.data_dir, 'accountsData.ibank')
+    if os.path.exists(path):
+        os.remove(path)
+
+    db = sqlite3.connect(path)
+    db.executescript(SCHEMA)
+    securities = [(str(uuid.UUID(int=i)).upper(), symbol_for(i)) for i in range(args.securities)]
+    db.executemany(
+        'INSERT INTO zsecurity (z_ent, z_opt, zuniqueid, zsymbol, zname) VALUES (49, 1, ?, ?, ?)',
+        [(security_id, symbol, f'{symbol} Inc.') for security_id, symbol in securities]
+    )
+    today = datetime.datetime.combine(datetime.date.today(), datetime.time())
+    db.executemany(
+        'INSERT INTO zprice (z_ent, z_opt, zdate, zsecurityid, zvolume, '
+        'zclosingprice, zhighprice, zlowprice, zopeningprice) VALUES (?, ?, ?, ?, 1000, 1, 1, 1, 1)',
+        (
+            (ENT, OPT, int((today - datetime.timedelta(days=day)).timestamp()) - IBANK_EPOCH, security_id)
+            for security_id, _ in securities
+            for day in range(1, args.price_days + 1)
+        )
+    )
+    db.execute("INSERT INTO z_primarykey VALUES (?, 'Price', 0, (SELECT IFNULL(MAX(z_pk), 0) FROM zprice))", (ENT,))
+    db.commit()
+    db.close()
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,166 @@
+"""Local stand-in for the Yahoo Finance CSV download endpoint, and the batch quote API.
+
+Serves deterministic, synthetic price histories for any symbol, with
+configurable latency, chunking, error rates and history length, so that
+ibdq can be benchmarked without hitting query1.finance.yahoo.com.
+Responses carry an ETag, and matching If-None-Match requests get HTTP 304.
+
+Prices are served from any path ending in the symbol, e.g.:
+    http://127.0.0.1:<port>/download/AAPL?interval=1d&events=history
+
+and latest prices of several symbols, as JSON, from any path given symbols:
+    http://127.0.0.1:<port>/quotes?symbols=AAPL,MSFT
+"""
+import argparse
+import datetime
+import http.server
+import json
+import random
+import sys
+import time
+import urllib.parse
+import zlib
+
+
+CSV_HEADER = 'Date,Open,High,Low,Close,Adj Close,Volume'
+
+
+def price_rows(symbol, days, end_date):
+    rng = random.Random(zlib.crc32(symbol.encode()))
+    price = rng.uniform(5, 500)
+    rows = []
+    for offset in range(days - 1, -1, -1):
+        date = end_date - datetime.timedelta(days=offset)
+        if date.weekday() >= 5:
+            continue
+        open_ = price
+        close = max(0.01, open_ * rng.uniform(0.97, 1.03))
+        high = max(open_, close) * rng.uniform(1.0, 1.01)
+        low = min(open_, close) * rng.uniform(0.99, 1.0)
+        volume = rng.randint(1000, 50_000_000)
+        rows.append((date, open_, high, low, close, volume))
+        price = close
+
+    return rows
+
+
+def csv_row(row):
+    date, open_, high, low, close, volume = row
+
+    return f'{date.isoformat()},{open_:.6f},{high:.6f},{low:.6f},{close:.6f},{close:.6f},{volume}'
+
+
+def json_price(row):
+    date, open_, high, low, close, volume = row
+    midnight = datetime.datetime.combine(date, datetime.time(), datetime.timezone.utc)
+
+    return {
+        'millisSinceEpoch': int(midnight.timestamp()) * 1000,
+        'open': round(open_, 6),
+        'high': round(high, 6),
+        'low': round(low, 6),
+        'close': round(close, 6),
+        'volume': volume,
+    }
+
+
+def make_handler(args):
+    class QuoteHandler(http.server.BaseHTTPRequestHandler):
+        protocol_version = 'HTTP/1.1'
+        # Avoids delayed-ACK stalls between header and body writes
+        disable_nagle_algorithm = True
+
+        def do_GET(self):
+            url = urllib.parse.urlparse(self.path)
+            symbol = urllib.parse.unquote(url.path.rsplit('/', 1)[-1])
+            query = urllib.parse.parse_qs(url.query)
+            delay = max(0.0, random.gauss(args.latency_ms, args.jitter_ms) / 1000)
+            if delay:
+                time.sleep(delay)
+
+            roll = random.random()
+            if roll < args.throttle_rate:
+                self.send_body(429, b'Too Many Requests', 'text/plain')
+                return
+            if roll < args.throttle_rate + args.error_rate:
+                self.send_body(503, b'Service Unavailable', 'text/plain')
+                return
+
+            if 'symbols' in query:
+                # Symbols without a price today (e.g. at weekends) are left out
+                by_symbol = {}
+                for symbol in query['symbols'][0].split(','):
+                    rows = price_rows(symbol, 1, datetime.date.today())
+                    if rows:
+                        by_symbol[symbol] = json_price(rows[-1])
+                body = json.dumps({'bySymbol': by_symbol}).encode()
+                content_type = 'application/json'
+            else:
+                rows = self.requested_rows(symbol, query)
+                if rows is None:
+                    self.send_body(400, b'Bad Request', 'text/plain')
+                    return
+                body = '\n'.join([CSV_HEADER] + [csv_row(row) for row in rows]).encode()
+                content_type = 'text/csv'
+            etag = f'"{zlib.crc32(body):08x}"'
+            if self.headers.get('If-None-Match') == etag:
+                self.send_body(304, b'', None, etag)
+                return
+            self.send_body(200, body, content_type, etag)
+
+        def requested_rows(self, symbol, query):
+            """Rows between period1 and period2, if given, or else the latest, None if the range is invalid."""
+            if 'period1' not in query:
+                return price_rows(symbol, 1, datetime.date.today())
+            try:
+                start, end = [datetime.datetime.fromtimestamp(int(query[name][0]), datetime.timezone.utc).date()
+                              for name in ('period1', 'period2')]
+            except (KeyError, ValueError, OverflowError, OSError):
+                return None
+
+            # Taken from the whole history, so that a day has the same price in every range
+            return [row for row in price_rows(symbol, args.history_days, datetime.date.today())
+                    if start <= row[0] <= end]
+
+        def send_body(self, status, body, content_type, etag=None):
+            self.send_response(status)
+            if etag:
+                self.send_header('ETag', etag)
+            if content_type:
+                self.send_header('Content-Type', content_type)
+            self.send_header('Content-Length', str(len(body)))
+            self.end_headers()
+            chunk_size = args.chunk_size or len(body) or 1
+            for i in range(0, len(body), chunk_size):
+                self.wfile.write(body[i:i + chunk_size])
+                self.wfile.flush()
+
+        def log_message(self, format, *args):
+            pass
+
+    return QuoteHandler
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--port', type=int, default=0, help='port to listen on (default: any free port)')
+    parser.add_argument('--latency-ms', type=float, default=0, help='mean response latency')
+    parser.add_argument('--jitter-ms', type=float, default=0, help='standard deviation of response latency')
+    parser.add_argument('--chunk-size', type=int, default=0, help='bytes per write (default: whole body)')
+    parser.add_argument('--error-rate', type=float, default=0, help='fraction of HTTP 503 responses')
+    parser.add_argument('--throttle-rate', type=float, default=0, help='fraction of HTTP 429 responses')
+    parser.add_argument('--history-days', type=int, default=3650, help='calendar days of history, when a range is requested')
+    args = parser.parse_args()
+
+    http.server.ThreadingHTTPServer.request_queue_size = 1024
+    http.server.ThreadingHTTPServer.daemon_threads = True
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', args.port), make_handler(args))
+    print(f'Listening on port {server.server_address[1]}', flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    sys.exit(main())
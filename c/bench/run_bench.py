@@ -0,0 +1,163 @@
+"""Reproducible benchmark harness for ibdq.
+
+Starts the local quote server, generates a synthetic data directory, runs
+ibdq against both, and reports throughput, per-symbol latency percentiles,
+phase timings and peak RSS.
+"""
+import argparse
+import os
+import re
+import shlex
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+LOG_LINE = re.compile(r'^\S+ \S+ (\w+)\s+\S+: (.*)$')
+SYMBOL_LATENCY = re.compile(r'^Downloaded prices for (\S+) in ([\d.]+)s')
+PHASES = {
+    'read': re.compile(r'^Read securities in ([\d.]+)s'),
+    'download': re.compile(r'^Downloaded prices in ([\d.]+)s'),
+    'commit': re.compile(r'^Merged and committed prices in ([\d.]+)s'),
+    'total': re.compile(r'^Security prices synchronized in ([\d.]+)s'),
+}
+SERVER_ARGS = ('latency_ms', 'jitter_ms', 'chunk_size', 'error_rate', 'throttle_rate', 'history_days')
+
+
+def percentile(values, fraction):
+    if not values:
+        return float('nan')
+    ordered = sorted(values)
+
+    return ordered[min(len(ordered) - 1, int(round(fraction * (len(ordered) - 1))))]
+
+
+def start_server(args):
+    command = [sys.executable, os.path.join(BENCH_DIR, 'quote_server.py')]
+    for name in SERVER_ARGS:
+        command += ['--' + name.replace('_', '-'), str(getattr(args, name))]
+    server = subprocess.Popen(command, stdout=subprocess.PIPE, text=True)
+    port = int(server.stdout.readline().split()[-1])
+
+    return server, port
+
+
+def run_ibdq(args, data_dir, price_url, batch_url):
+    command = ([args.ibdq, '--price-url', price_url, '--batch-url', batch_url] +
+               shlex.split(args.ibdq_args) + [data_dir])
+    with tempfile.TemporaryFile(mode='w+') as output:
+        process = subprocess.Popen(command, stdout=output, stderr=subprocess.STDOUT)
+        _, status, usage = os.wait4(process.pid, 0)
+        output.seek(0)
+        lines = output.read().splitlines()
+
+    result = {'status': os.waitstatus_to_exitcode(status), 'latencies': [], 'errors': 0}
+    # ru_maxrss is in kilobytes on Linux, and bytes on macOS
+    result['max_rss_mb'] = usage.ru_maxrss / (1024 * 1024 if sys.platform == 'darwin' else 1024)
+    for line in lines:
+        match = LOG_LINE.match(line)
+        if not match:
+            continue
+        level, message = match.groups()
+        if level in ('ERROR', 'FATAL'):
+            result['errors'] += 1
+        latency = SYMBOL_LATENCY.match(message)
+        if latency:
+            result['latencies'].append(float(latency.group(2)))
+        for phase, pattern in PHASES.items():
+            phase_match = pattern.match(message)
+            if phase_match:
+                result[phase] = float(phase_match.group(1))
+    if result['status'] != 0:
+        sys.stderr.write('\n'.join(lines[-20:]) + '\n')
+
+    return result
+
+
+def report(results, securities):
+    columns = ('run', 'total', 'read', 'download', 'commit', 'symbols/s', 'p50', 'p99', 'rss MB', 'errors')
+    print(('{:>10}' * len(columns)).format(*columns))
+    for run, result in enumerate(results, 1):
+        print(format_row(str(run), result, securities))
+    if len(results) > 1:
+        median = {
+            key: statistics.median(result.get(key, float('nan')) for result in results)
+            for key in ('total', 'read', 'download', 'commit', 'max_rss_mb', 'errors')
+        }
+        median['latencies'] = [latency for result in results for latency in result['latencies']]
+        print(format_row('median', median, securities))
+
+
+def format_row(label, result, securities):
+    download = result.get('download', float('nan'))
+    latencies = result['latencies']
+
+    return '{:>10}{:>10.3f}{:>10.3f}{:>10.3f}{:>10.3f}{:>10.1f}{:>10.3f}{:>10.3f}{:>10.1f}{:>10}'.format(
+        label,
+        result.get('total', float('nan')),
+        result.get('read', float('nan')),
+        download,
+        result.get('commit', float('nan')),
+        securities / download if download else float('nan'),
+        percentile(latencies, 0.50),
+        percentile(latencies, 0.99),
+        result['max_rss_mb'],
+        int(result['errors']),
+    )
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--ibdq', required=True, help='path to the ibdq executable')
+    parser.add_argument('--ibdq-args', default='', help='extra ibdq arguments, e.g. --ibdq-args="-p -e"')
+    parser.add_argument('--securities', default='1000',
+                        help='number of securities in the book, or a comma-separated list of sizes to compare, '
+                             'e.g. 1000,10000,50000 to check peak RSS stays flat')
+    parser.add_argument('--price-days', type=int, default=0, help='days of existing prices per security')
+    parser.add_argument('--runs', type=int, default=3, help='number of runs')
+    parser.add_argument('--latency-ms', type=float, default=20, help='mean quote server latency')
+    parser.add_argument('--jitter-ms', type=float, default=5, help='standard deviation of quote server latency')
+    parser.add_argument('--chunk-size', type=int, default=0, help='quote server bytes per write')
+    parser.add_argument('--error-rate', type=float, default=0, help='fraction of HTTP 503 responses')
+    parser.add_argument('--throttle-rate', type=float, default=0, help='fraction of HTTP 429 responses')
+    parser.add_argument('--history-days', type=int, default=3650, help='calendar days of history, when backfilling')
+    args = parser.parse_args()
+
+    work_dir = tempfile.mkdtemp(prefix='ibdq-bench-')
+    template_dir = os.path.join(work_dir, 'template')
+    data_dir = os.path.join(work_dir, 'book')
+    server, port = start_server(args)
+    price_url = f'http://127.0.0.1:{port}/download/%s?interval=1d&events=history'
+    batch_url = f'http://127.0.0.1:{port}/quotes?symbols=%s'
+    results = []
+    try:
+        for securities in (int(size) for size in args.securities.split(',')):
+            shutil.rmtree(template_dir, ignore_errors=True)
+            subprocess.run(
+                [sys.executable, os.path.join(BENCH_DIR, 'make_book.py'), template_dir,
+                 '--securities', str(securities), '--price-days', str(args.price_days)],
+                check=True
+            )
+            print(f'Benchmarking {args.ibdq} {args.ibdq_args} with {securities} securities...')
+            size_results = []
+            for _ in range(args.runs):
+                shutil.rmtree(data_dir, ignore_errors=True)
+                shutil.copytree(template_dir, data_dir)
+                size_results.append(run_ibdq(args, data_dir, price_url, batch_url))
+                time.sleep(0.1)
+            report(size_results, securities)
+            results += size_results
+    finally:
+        server.terminate()
+        server.wait()
+        shutil.rmtree(work_dir, ignore_errors=True)
+
+    return 1 if any(result['status'] != 0 for result in results) else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
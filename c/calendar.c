@@ -0,0 +1,145 @@
+/**
+ * Market calendar for ibdq - see calendar.h.
+ */
+
+#include "calendar.h"
+
+#define SECS_PER_DAY 86400L
+// Session times in UTC, approximated to cover both EST and EDT - the session
+// is considered open from the earliest open, and final an hour after the
+// latest close, so that end-of-day prices have settled
+#define SESSION_OPEN_UTC_SECS (13 * 3600L + 30 * 60L)
+#define SESSION_FINAL_UTC_SECS (22 * 3600L)
+
+enum { SUNDAY, MONDAY, TUESDAY, WEDNESDAY, THURSDAY, FRIDAY, SATURDAY };
+
+
+// Howard Hinnant's days_from_civil algorithm
+long calendar_days_from_civil(int year, int month, int mday) {
+    long y = month <= 2 ? year - 1 : year;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + mday - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + doe - 719468;
+}
+
+
+void calendar_civil_from_days(long days, int *year, int *month, int *mday) {
+    long z = days + 719468;
+    long era = (z >= 0 ? z : z - 146096) / 146097;
+    long doe = z - era * 146097;
+    long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long mp = (5 * doy + 2) / 153;
+
+    *mday = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *year = (int)(yoe + era * 400 + (*month <= 2));
+}
+
+
+static int weekday(long days) {
+    // 1970-01-01 was a Thursday
+    return (int)((days % 7 + 7 + THURSDAY) % 7);
+}
+
+
+static long last_day_of_month(int year, int month) {
+    return month == 12 ?
+        calendar_days_from_civil(year + 1, 1, 1) - 1 :
+        calendar_days_from_civil(year, month + 1, 1) - 1;
+}
+
+
+// The nth (1-based) given weekday of a month, or the last if n is 0
+static long nth_weekday(int year, int month, int wday, int n) {
+    if (n > 0) {
+        long first = calendar_days_from_civil(year, month, 1);
+        return first + (wday - weekday(first) + 7) % 7 + (n - 1) * 7;
+    } else {
+        long last = last_day_of_month(year, month);
+        return last - (weekday(last) - wday + 7) % 7;
+    }
+}
+
+
+// Anonymous Gregorian algorithm
+static long easter_sunday(int year) {
+    int a = year % 19, b = year / 100, c = year % 100;
+    int d = b / 4, e = b % 4, f = (b + 8) / 25, g = (b - f + 1) / 3;
+    int h = (19 * a + b - d - g + 15) % 30;
+    int i = c / 4, k = c % 4;
+    int l = (32 + 2 * e + 2 * i - h - k) % 7;
+    int m = (a + 11 * h + 22 * l) / 451;
+    int month = (h + l - 7 * m + 114) / 31;
+    int mday = (h + l - 7 * m + 114) % 31 + 1;
+
+    return calendar_days_from_civil(year, month, mday);
+}
+
+
+// Fixed-date holidays falling on a Saturday are observed the Friday before,
+// and those falling on a Sunday the Monday after
+static long observed(long days) {
+    switch (weekday(days)) {
+        case SATURDAY: return days - 1;
+        case SUNDAY: return days + 1;
+        default: return days;
+    }
+}
+
+
+static bool is_holiday(long days) {
+    int year, month, mday;
+    calendar_civil_from_days(days, &year, &month, &mday);
+
+    switch (month) {
+        case 1:
+            // New Year's Day is not observed on the preceding Friday
+            return (days == calendar_days_from_civil(year, 1, 1) && weekday(days) != SATURDAY) ||
+                (days == calendar_days_from_civil(year, 1, 2) && weekday(days) == MONDAY) ||
+                (year >= 1998 && days == nth_weekday(year, 1, MONDAY, 3));
+        case 2:
+            return days == nth_weekday(year, 2, MONDAY, 3);
+        case 3:
+        case 4:
+            return days == easter_sunday(year) - 2;
+        case 5:
+            return days == nth_weekday(year, 5, MONDAY, 0);
+        case 6:
+            return year >= 2022 && days == observed(calendar_days_from_civil(year, 6, 19));
+        case 7:
+            return days == observed(calendar_days_from_civil(year, 7, 4));
+        case 9:
+            return days == nth_weekday(year, 9, MONDAY, 1);
+        case 11:
+            return days == nth_weekday(year, 11, THURSDAY, 4);
+        case 12:
+            return days == observed(calendar_days_from_civil(year, 12, 25));
+        default:
+            return false;
+    }
+}
+
+
+bool calendar_is_trading_day(long days) {
+    int wday = weekday(days);
+
+    return wday != SATURDAY && wday != SUNDAY && !is_holiday(days);
+}
+
+
+long calendar_latest_trading_day(time_t now, bool *closed) {
+    long today = (long)(now / SECS_PER_DAY);
+    long secs = (long)(now - today * SECS_PER_DAY);
+    long days = secs < SESSION_OPEN_UTC_SECS ? today - 1 : today;
+
+    while (!calendar_is_trading_day(days)) {
+        days--;
+    }
+    *closed = days < today || secs >= SESSION_FINAL_UTC_SECS;
+
+    return days;
+}
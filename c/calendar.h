@@ -0,0 +1,24 @@
+/**
+ * Market calendar for ibdq.
+ *
+ * Dates are represented as days since 1970-01-01. Trading days follow the
+ * NYSE calendar - weekdays, excluding full-day exchange holidays.
+ */
+
+#ifndef CALENDAR_H
+#define CALENDAR_H
+
+#include <stdbool.h>
+#include <time.h>
+
+long calendar_days_from_civil(int year, int month, int mday);
+void calendar_civil_from_days(long days, int *year, int *month, int *mday);
+bool calendar_is_trading_day(long days);
+
+/*
+ * Latest trading day whose session has opened at the given time. closed is
+ * set if that session has also closed, and its prices are therefore final.
+ */
+long calendar_latest_trading_day(time_t now, bool *closed);
+
+#endif
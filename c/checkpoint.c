@@ -0,0 +1,287 @@
+/**
+ * Checkpoint journal of completed downloads, for ibdq - see checkpoint.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "checkpoint.h"
+
+/* Survives the process being killed, though not necessarily a power loss */
+#define PRAGMAS_SQL "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL"
+#define CREATE_SQL "\
+CREATE TABLE IF NOT EXISTS checkpoint_download (\
+    symbol TEXT NOT NULL,\
+    period_start INTEGER NOT NULL,\
+    generation INTEGER NOT NULL,\
+    PRIMARY KEY (symbol, period_start)\
+) WITHOUT ROWID;\
+CREATE TABLE IF NOT EXISTS checkpoint_price (\
+    symbol TEXT NOT NULL,\
+    period_start INTEGER NOT NULL,\
+    date INTEGER NOT NULL,\
+    open_units INTEGER,\
+    open_scale INTEGER,\
+    high_units INTEGER,\
+    high_scale INTEGER,\
+    low_units INTEGER,\
+    low_scale INTEGER,\
+    close_units INTEGER,\
+    close_scale INTEGER,\
+    volume INTEGER,\
+    PRIMARY KEY (symbol, period_start, date)\
+) WITHOUT ROWID"
+#define DISCARD_DOWNLOADS_SQL "DELETE FROM checkpoint_download WHERE generation != ?1"
+#define DISCARD_PRICES_SQL "\
+DELETE FROM checkpoint_price \
+WHERE NOT EXISTS (\
+    SELECT 1 FROM checkpoint_download AS d \
+    WHERE d.symbol = checkpoint_price.symbol AND d.period_start = checkpoint_price.period_start\
+)"
+#define CLEAR_SQL "DELETE FROM checkpoint_download; DELETE FROM checkpoint_price"
+#define ADD_ROW_SQL "\
+INSERT OR REPLACE INTO checkpoint_price (\
+    symbol, period_start, date,\
+    open_units, open_scale, high_units, high_scale, low_units, low_scale, close_units, close_scale, volume\
+) VALUES (\
+    ?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12\
+)"
+#define COMPLETE_SQL "\
+INSERT OR REPLACE INTO checkpoint_download (symbol, period_start, generation) \
+VALUES (?1, ?2, ?3)"
+#define LOOKUP_SQL "\
+SELECT 1 FROM checkpoint_download \
+WHERE symbol = ?1 AND period_start = ?2"
+#define REPLAY_SQL "\
+SELECT date, open_units, open_scale, high_units, high_scale, low_units, low_scale, close_units, close_scale, volume \
+FROM checkpoint_price \
+WHERE symbol = ?1 AND period_start = ?2 \
+ORDER BY date"
+#define COMMIT_INTERVAL_SECS 1.0
+#define REPLAY_INITIAL_ROWS 256
+/* Dates are stored as yyyymmdd */
+#define DATE_YEAR 10000
+#define DATE_MONTH 100
+
+
+static double now_secs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1.0e9;
+}
+
+
+int checkpoint_open(checkpoint *journal, const char *path) {
+    memset(journal, 0, sizeof(checkpoint));
+    pthread_mutex_init(&journal->mutex, NULL);
+    if (sqlite3_open(path, &journal->db) != SQLITE_OK ||
+            sqlite3_exec(journal->db, PRAGMAS_SQL, NULL, NULL, NULL) != SQLITE_OK ||
+            sqlite3_exec(journal->db, CREATE_SQL, NULL, NULL, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(journal->db, ADD_ROW_SQL, -1, &journal->add_row_stmt, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(journal->db, COMPLETE_SQL, -1, &journal->complete_stmt, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(journal->db, LOOKUP_SQL, -1, &journal->lookup_stmt, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(journal->db, REPLAY_SQL, -1, &journal->replay_stmt, NULL) != SQLITE_OK) {
+        checkpoint_close(journal);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void checkpoint_close(checkpoint *journal) {
+    sqlite3_finalize(journal->add_row_stmt);
+    sqlite3_finalize(journal->complete_stmt);
+    sqlite3_finalize(journal->lookup_stmt);
+    sqlite3_finalize(journal->replay_stmt);
+    sqlite3_close(journal->db);
+    pthread_mutex_destroy(&journal->mutex);
+    memset(journal, 0, sizeof(checkpoint));
+}
+
+
+int checkpoint_begin(checkpoint *journal, long generation) {
+    sqlite3_stmt *stmt = NULL;
+    int ret = -1;
+
+    pthread_mutex_lock(&journal->mutex);
+    journal->generation = generation;
+    journal->replayed = 0;
+    journal->committed_at = now_secs();
+    if (sqlite3_exec(journal->db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK &&
+            sqlite3_prepare_v2(journal->db, DISCARD_DOWNLOADS_SQL, -1, &stmt, NULL) == SQLITE_OK &&
+            sqlite3_bind_int64(stmt, 1, generation) == SQLITE_OK &&
+            sqlite3_step(stmt) == SQLITE_DONE &&
+            sqlite3_exec(journal->db, DISCARD_PRICES_SQL, NULL, NULL, NULL) == SQLITE_OK) {
+        ret = 0;
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&journal->mutex);
+
+    return ret;
+}
+
+
+int checkpoint_end(checkpoint *journal, bool clear) {
+    int ret = 0;
+
+    pthread_mutex_lock(&journal->mutex);
+    if (clear && sqlite3_exec(journal->db, CLEAR_SQL, NULL, NULL, NULL) != SQLITE_OK) {
+        ret = -1;
+    }
+    if (sqlite3_exec(journal->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&journal->mutex);
+
+    return ret;
+}
+
+
+/* Commits appends at most once per interval - called with the mutex held */
+static void commit_periodically(checkpoint *journal) {
+    double now = now_secs();
+
+    if (now - journal->committed_at >= COMMIT_INTERVAL_SECS &&
+            sqlite3_exec(journal->db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK) {
+        sqlite3_exec(journal->db, "BEGIN", NULL, NULL, NULL);
+        journal->committed_at = now;
+    }
+}
+
+
+static void bind_decimal(sqlite3_stmt *stmt, int index, const price_decimal *decimal) {
+    if (decimal->present) {
+        sqlite3_bind_int64(stmt, index, decimal->units);
+        sqlite3_bind_int(stmt, index + 1, decimal->scale);
+    }
+}
+
+
+static void column_decimal(sqlite3_stmt *stmt, int col, price_decimal *decimal) {
+    memset(decimal, 0, sizeof(price_decimal));
+    if (sqlite3_column_type(stmt, col) != SQLITE_NULL) {
+        decimal->units = sqlite3_column_int64(stmt, col);
+        decimal->scale = (int8_t)sqlite3_column_int(stmt, col + 1);
+        decimal->point = decimal->scale > 0;
+        decimal->present = true;
+    }
+}
+
+
+int checkpoint_add_row(checkpoint *journal, const char *symbol, long period_start, const price_row *row) {
+    sqlite3_stmt *stmt = journal->add_row_stmt;
+    int ret;
+
+    pthread_mutex_lock(&journal->mutex);
+    sqlite3_bind_text(stmt, 1, symbol, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, period_start);
+    sqlite3_bind_int64(stmt, 3, (row->date.tm_year + 1900L) * DATE_YEAR + (row->date.tm_mon + 1) * DATE_MONTH +
+                                row->date.tm_mday);
+    bind_decimal(stmt, 4, &row->open);
+    bind_decimal(stmt, 6, &row->high);
+    bind_decimal(stmt, 8, &row->low);
+    bind_decimal(stmt, 10, &row->close);
+    sqlite3_bind_int64(stmt, 12, row->volume);
+    ret = sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    commit_periodically(journal);
+    pthread_mutex_unlock(&journal->mutex);
+
+    return ret;
+}
+
+
+int checkpoint_complete(checkpoint *journal, const char *symbol, long period_start) {
+    sqlite3_stmt *stmt = journal->complete_stmt;
+    int ret;
+
+    pthread_mutex_lock(&journal->mutex);
+    sqlite3_bind_text(stmt, 1, symbol, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, period_start);
+    sqlite3_bind_int64(stmt, 3, journal->generation);
+    ret = sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    commit_periodically(journal);
+    pthread_mutex_unlock(&journal->mutex);
+
+    return ret;
+}
+
+
+/* Reads the rows of a download into a buffer - called with the mutex held */
+static bool read_replay_rows(checkpoint *journal, const char *symbol, long period_start,
+                             price_row **rows, int *count) {
+    sqlite3_stmt *stmt = journal->replay_stmt;
+    int capacity = 0;
+    bool ok = true;
+
+    *rows = NULL;
+    *count = 0;
+    sqlite3_bind_text(stmt, 1, symbol, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, period_start);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        long date = (long)sqlite3_column_int64(stmt, 0);
+        price_row *row;
+
+        if (*count == capacity) {
+            price_row *grown;
+
+            capacity = capacity ? capacity * 2 : REPLAY_INITIAL_ROWS;
+            grown = realloc(*rows, capacity * sizeof(price_row));
+            if (grown == NULL) {
+                ok = false;
+                break;
+            }
+            *rows = grown;
+        }
+        row = &(*rows)[(*count)++];
+        memset(row, 0, sizeof(price_row));
+        row->date.tm_year = (int)(date / DATE_YEAR) - 1900;
+        row->date.tm_mon = (int)(date / DATE_MONTH % DATE_MONTH) - 1;
+        row->date.tm_mday = (int)(date % DATE_MONTH);
+        column_decimal(stmt, 1, &row->open);
+        column_decimal(stmt, 3, &row->high);
+        column_decimal(stmt, 5, &row->low);
+        column_decimal(stmt, 7, &row->close);
+        row->volume = sqlite3_column_int64(stmt, 9);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    return ok;
+}
+
+
+bool checkpoint_replay(checkpoint *journal, const char *symbol, long period_start,
+                       checkpoint_row_fn on_row, void *ctx) {
+    sqlite3_stmt *stmt = journal->lookup_stmt;
+    price_row *rows = NULL;
+    int count = 0;
+    bool completed;
+
+    pthread_mutex_lock(&journal->mutex);
+    sqlite3_bind_text(stmt, 1, symbol, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, period_start);
+    completed = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    /* Downloaded again, should its rows not fit in memory */
+    if (completed) completed = read_replay_rows(journal, symbol, period_start, &rows, &count);
+    if (completed) journal->replayed++;
+    pthread_mutex_unlock(&journal->mutex);
+
+    /* Rows are handed over with the mutex released, as on_row may block on a
+       writer, while other workers journal their downloads */
+    for (int i = 0; completed && i < count; i++) {
+        if (!on_row(ctx, &rows[i])) break;
+    }
+    free(rows);
+
+    return completed;
+}
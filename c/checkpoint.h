@@ -0,0 +1,60 @@
+/**
+ * Checkpoint journal of completed downloads, for resumable runs of ibdq.
+ *
+ * Rows parsed from each download are appended to a sidecar SQLite file as
+ * they arrive, keyed by symbol and the start of the requested range, and the
+ * download is marked complete once all have been parsed. A run that is
+ * killed, or fails before its books commit, leaves the journal behind, and
+ * the next run replays the downloads it completed instead of repeating them.
+ * Rows of downloads never marked complete are discarded, as are those of an
+ * earlier generation (e.g. trading day).
+ *
+ * Appends are committed about once a second, rather than per download, so a
+ * crash costs at most the last second of progress.
+ *
+ * Thread-safe - prepared statements are reused, so calls are serialized,
+ * though replayed rows are handed over once the journal is unlocked.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "price_csv.h"
+
+typedef struct checkpoint {
+    sqlite3 *db;
+    sqlite3_stmt *add_row_stmt;
+    sqlite3_stmt *complete_stmt;
+    sqlite3_stmt *lookup_stmt;
+    sqlite3_stmt *replay_stmt;
+    /* Generation of the refresh in progress, and when appends were last committed */
+    long generation;
+    double committed_at;
+    /* Downloads replayed since checkpoint_begin */
+    int replayed;
+    pthread_mutex_t mutex;
+} checkpoint;
+
+/* Receives each row replayed */
+typedef bool (*checkpoint_row_fn)(void *ctx, price_row *row);
+
+int checkpoint_open(checkpoint *journal, const char *path);
+void checkpoint_close(checkpoint *journal);
+
+/* Starts a refresh, discarding incomplete downloads, and those of other generations */
+int checkpoint_begin(checkpoint *journal, long generation);
+/* Ends a refresh, clearing the journal once its rows have been committed to every book */
+int checkpoint_end(checkpoint *journal, bool clear);
+
+int checkpoint_add_row(checkpoint *journal, const char *symbol, long period_start, const price_row *row);
+int checkpoint_complete(checkpoint *journal, const char *symbol, long period_start);
+
+/* Hands the rows of a completed download to on_row, in order of date, returning false if not completed */
+bool checkpoint_replay(checkpoint *journal, const char *symbol, long period_start,
+                       checkpoint_row_fn on_row, void *ctx);
+
+#endif
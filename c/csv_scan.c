@@ -0,0 +1,80 @@
+/**
+ * Vectorized CSV delimiter scanning for ibdq - see csv_scan.h.
+ */
+
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "csv_scan.h"
+
+
+const char *csv_scan_isa(void) {
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+
+const char *csv_scan_delim_scalar(const char *p, const char *end) {
+    while (p < end && *p != ',' && *p != '\n') {
+        p++;
+    }
+
+    return p;
+}
+
+
+const char *csv_scan_delim(const char *p, const char *end) {
+#if defined(__AVX2__)
+    const __m256i comma32 = _mm256_set1_epi8(',');
+    const __m256i newline32 = _mm256_set1_epi8('\n');
+
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, comma32), _mm256_cmpeq_epi8(chunk, newline32)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+    const __m128i comma16 = _mm_set1_epi8(',');
+    const __m128i newline16 = _mm_set1_epi8('\n');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, comma16), _mm_cmpeq_epi8(chunk, newline16)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t comma16 = vdupq_n_u8(',');
+    const uint8x16_t newline16 = vdupq_n_u8('\n');
+
+    for (; end - p >= 16; p += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t*)p);
+        uint8x16_t matches = vorrq_u8(vceqq_u8(chunk, comma16), vceqq_u8(chunk, newline16));
+        /* Narrows each byte of the comparison to 4 bits of a 64-bit mask */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+        if (mask) {
+            return p + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+#endif
+
+    return csv_scan_delim_scalar(p, end);
+}
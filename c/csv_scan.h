@@ -0,0 +1,19 @@
+/**
+ * Vectorized CSV delimiter scanning for ibdq.
+ *
+ * Finds the next field (',') or record ('\n') delimiter 32 (AVX2) or 16
+ * (SSE2/NEON) bytes at a time, with a scalar fallback for other targets and
+ * for the tail of each buffer.
+ */
+
+#ifndef CSV_SCAN_H
+#define CSV_SCAN_H
+
+/* Instruction set in use - "avx2", "sse2", "neon" or "scalar" */
+const char *csv_scan_isa(void);
+
+/* Next ',' or '\n' in [p, end), or end if there is none */
+const char *csv_scan_delim(const char *p, const char *end);
+const char *csv_scan_delim_scalar(const char *p, const char *end);
+
+#endif
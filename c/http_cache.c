@@ -0,0 +1,151 @@
+/**
+ * Persistent HTTP response cache for ibdq - see http_cache.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_cache.h"
+
+/* A cache, so durability is traded for not syncing on every stored response */
+#define PRAGMAS_SQL "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL"
+#define CREATE_SQL "\
+CREATE TABLE IF NOT EXISTS http_response (\
+    url TEXT NOT NULL,\
+    period_start INTEGER NOT NULL,\
+    etag TEXT,\
+    last_modified TEXT,\
+    fetched_at INTEGER NOT NULL,\
+    body BLOB NOT NULL,\
+    PRIMARY KEY (url, period_start)\
+) WITHOUT ROWID"
+#define LOOKUP_SQL "\
+SELECT etag, last_modified, fetched_at, body \
+FROM http_response \
+WHERE url = ?1 AND period_start = ?2"
+#define STORE_SQL "\
+INSERT OR REPLACE INTO http_response (\
+    url, period_start, etag, last_modified, fetched_at, body\
+) VALUES (\
+    ?1, ?2, ?3, ?4, ?5, ?6\
+)"
+#define TOUCH_SQL "\
+UPDATE http_response \
+SET fetched_at = ?3 \
+WHERE url = ?1 AND period_start = ?2"
+
+
+int http_cache_open(http_cache *cache, const char *path, long ttl) {
+    memset(cache, 0, sizeof(http_cache));
+    cache->ttl = ttl;
+    pthread_mutex_init(&cache->mutex, NULL);
+    if (sqlite3_open(path, &cache->db) != SQLITE_OK ||
+            sqlite3_exec(cache->db, PRAGMAS_SQL, NULL, NULL, NULL) != SQLITE_OK ||
+            sqlite3_exec(cache->db, CREATE_SQL, NULL, NULL, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(cache->db, LOOKUP_SQL, -1, &cache->lookup_stmt, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(cache->db, STORE_SQL, -1, &cache->store_stmt, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(cache->db, TOUCH_SQL, -1, &cache->touch_stmt, NULL) != SQLITE_OK) {
+        http_cache_close(cache);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void http_cache_close(http_cache *cache) {
+    sqlite3_finalize(cache->lookup_stmt);
+    sqlite3_finalize(cache->store_stmt);
+    sqlite3_finalize(cache->touch_stmt);
+    sqlite3_close(cache->db);
+    pthread_mutex_destroy(&cache->mutex);
+    memset(cache, 0, sizeof(http_cache));
+}
+
+
+static void copy_column_text(char *dest, sqlite3_stmt *stmt, int col) {
+    const unsigned char *text = sqlite3_column_text(stmt, col);
+
+    snprintf(dest, HTTP_CACHE_MAX_VALIDATOR_LEN, "%s", text ? (const char*)text : "");
+}
+
+
+bool http_cache_lookup(http_cache *cache, const char *url, long period_start, http_cache_entry *entry) {
+    sqlite3_stmt *stmt = cache->lookup_stmt;
+    bool found = false;
+
+    memset(entry, 0, sizeof(http_cache_entry));
+    pthread_mutex_lock(&cache->mutex);
+    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, period_start);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        int len = sqlite3_column_bytes(stmt, 3);
+
+        if ((entry->body = malloc(len + 1)) != NULL) {
+            memcpy(entry->body, sqlite3_column_blob(stmt, 3), len);
+            entry->body[len] = '\0';
+            entry->len = len;
+            copy_column_text(entry->etag, stmt, 0);
+            copy_column_text(entry->last_modified, stmt, 1);
+            entry->fetched_at = (long)sqlite3_column_int64(stmt, 2);
+            found = true;
+        }
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    pthread_mutex_unlock(&cache->mutex);
+
+    return found;
+}
+
+
+bool http_cache_is_fresh(const http_cache *cache, const http_cache_entry *entry) {
+    return time(NULL) - entry->fetched_at < cache->ttl;
+}
+
+
+void http_cache_entry_free(http_cache_entry *entry) {
+    free(entry->body);
+    entry->body = NULL;
+    entry->len = 0;
+}
+
+
+int http_cache_store(http_cache *cache, const char *url, long period_start, const http_cache_entry *entry) {
+    sqlite3_stmt *stmt = cache->store_stmt;
+    int ret;
+
+    pthread_mutex_lock(&cache->mutex);
+    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, period_start);
+    if (entry->etag[0]) sqlite3_bind_text(stmt, 3, entry->etag, -1, SQLITE_STATIC);
+    if (entry->last_modified[0]) sqlite3_bind_text(stmt, 4, entry->last_modified, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, entry->fetched_at);
+    sqlite3_bind_blob(stmt, 6, entry->len ? entry->body : "", (int)entry->len, SQLITE_STATIC);
+    ret = sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    pthread_mutex_unlock(&cache->mutex);
+
+    return ret;
+}
+
+
+int http_cache_touch(http_cache *cache, const char *url, long period_start) {
+    sqlite3_stmt *stmt = cache->touch_stmt;
+    int ret;
+
+    pthread_mutex_lock(&cache->mutex);
+    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, period_start);
+    sqlite3_bind_int64(stmt, 3, time(NULL));
+    ret = sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    pthread_mutex_unlock(&cache->mutex);
+
+    return ret;
+}
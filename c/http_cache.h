@@ -0,0 +1,51 @@
+/**
+ * Persistent HTTP response cache for ibdq.
+ *
+ * Responses are stored in a sidecar SQLite file, keyed by URL and the start
+ * of the requested range, along with their ETag and Last-Modified validators.
+ *
+ * Thread-safe - prepared statements are reused, so calls are serialized.
+ */
+
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#define HTTP_CACHE_MAX_VALIDATOR_LEN 128
+
+typedef struct http_cache {
+    sqlite3 *db;
+    sqlite3_stmt *lookup_stmt;
+    sqlite3_stmt *store_stmt;
+    sqlite3_stmt *touch_stmt;
+    /* Seconds for which a response is used without revalidation */
+    long ttl;
+    pthread_mutex_t mutex;
+} http_cache;
+
+typedef struct http_cache_entry {
+    char etag[HTTP_CACHE_MAX_VALIDATOR_LEN];
+    char last_modified[HTTP_CACHE_MAX_VALIDATOR_LEN];
+    long fetched_at;
+    /* NUL-terminated, as parse errors log the body */
+    char *body;
+    size_t len;
+} http_cache_entry;
+
+int http_cache_open(http_cache *cache, const char *path, long ttl);
+void http_cache_close(http_cache *cache);
+
+/* Returns true and fills entry if found - release it with http_cache_entry_free */
+bool http_cache_lookup(http_cache *cache, const char *url, long period_start, http_cache_entry *entry);
+bool http_cache_is_fresh(const http_cache *cache, const http_cache_entry *entry);
+void http_cache_entry_free(http_cache_entry *entry);
+
+int http_cache_store(http_cache *cache, const char *url, long period_start, const http_cache_entry *entry);
+/* Marks a revalidated (HTTP 304) response as fetched now */
+int http_cache_touch(http_cache *cache, const char *url, long period_start);
+
+#endif
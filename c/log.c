@@ -20,6 +20,9 @@
  * IN THE SOFTWARE.
  */
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -28,13 +31,41 @@
 
 #include "log.h"
 
+/* Messages queued for the flusher thread - a power of two */
+#define RING_SIZE 1024
+/* Longer messages are allocated */
+#define ENTRY_TEXT_LEN 256
+#define FLUSH_INTERVAL_NS 50000000L
+
+typedef struct {
+  /* Position this entry may next be written (pos) or read (pos + 1) at */
+  atomic_size_t seq;
+  time_t time;
+  int level;
+  /* "file:line: " */
+  int prefix_len;
+  char *long_text;
+  char text[ENTRY_TEXT_LEN];
+} log_entry;
+
 static struct {
   void *udata;
   log_LockFn lock;
   FILE *fp;
   int level;
   int quiet;
-} L;
+  /* Bounded ring - any thread enqueues without locking, one thread at a
+   * time, holding drain_mutex, writes entries out */
+  log_entry ring[RING_SIZE];
+  atomic_size_t tail;
+  size_t head;
+  pthread_mutex_t drain_mutex;
+  pthread_once_t started;
+  /* Timestamps are formatted once per second */
+  time_t stamp_time;
+  char short_stamp[16];
+  char long_stamp[32];
+} L = { .drain_mutex = PTHREAD_MUTEX_INITIALIZER, .started = PTHREAD_ONCE_INIT, .stamp_time = -1 };
 
 
 static const char *level_names[] = {
@@ -62,6 +93,114 @@ static void unlock(void) {
 }
 
 
+static void *run_flusher(void *unused) {
+  struct timespec interval = { 0, FLUSH_INTERVAL_NS };
+  (void)unused;
+
+  for (;;) {
+    nanosleep(&interval, NULL);
+    log_flush();
+  }
+
+  return NULL;
+}
+
+
+static void start(void) {
+  pthread_t flusher;
+
+  for (size_t i = 0; i < RING_SIZE; i++) {
+    atomic_init(&L.ring[i].seq, i);
+  }
+  atexit(log_flush);
+  /* Without a flusher, messages are written whenever the ring fills */
+  if (pthread_create(&flusher, NULL, run_flusher, NULL) == 0) {
+    pthread_detach(flusher);
+  }
+}
+
+
+static void write_entry(log_entry *entry) {
+  const char *text = entry->long_text ? entry->long_text : entry->text;
+
+  if (entry->time != L.stamp_time) {
+    struct tm lt;
+    localtime_r(&entry->time, &lt);
+    strftime(L.short_stamp, sizeof(L.short_stamp), "%H:%M:%S", &lt);
+    strftime(L.long_stamp, sizeof(L.long_stamp), "%Y-%m-%d %H:%M:%S", &lt);
+    L.stamp_time = entry->time;
+  }
+
+  /* Log to stderr */
+  if (!L.quiet) {
+#ifdef LOG_USE_COLOR
+    fprintf(
+      stderr, "%s %s%-5s\x1b[0m \x1b[90m%.*s\x1b[0m%s\n",
+      L.short_stamp, level_colors[entry->level], level_names[entry->level],
+      entry->prefix_len - 1, text, text + entry->prefix_len - 1);
+#else
+    fprintf(stderr, "%s %-5s %s\n", L.short_stamp, level_names[entry->level], text);
+#endif
+  }
+
+  /* Log to file */
+  if (L.fp) {
+    fprintf(L.fp, "%s %-5s %s\n", L.long_stamp, level_names[entry->level], text);
+  }
+}
+
+
+void log_flush(void) {
+  int written = 0;
+
+  pthread_mutex_lock(&L.drain_mutex);
+  lock();
+  for (;;) {
+    log_entry *entry = &L.ring[L.head & (RING_SIZE - 1)];
+
+    /* Stops at the first entry not yet published */
+    if (atomic_load_explicit(&entry->seq, memory_order_acquire) != L.head + 1) {
+      break;
+    }
+    write_entry(entry);
+    free(entry->long_text);
+    entry->long_text = NULL;
+    atomic_store_explicit(&entry->seq, L.head + RING_SIZE, memory_order_release);
+    L.head++;
+    written++;
+  }
+  if (written) {
+    if (!L.quiet) fflush(stderr);
+    if (L.fp) fflush(L.fp);
+  }
+  unlock();
+  pthread_mutex_unlock(&L.drain_mutex);
+}
+
+
+/* Claims the entry at the tail of the ring, writing entries out from this
+ * thread while it is full */
+static log_entry *claim_entry(size_t *pos) {
+  *pos = atomic_load_explicit(&L.tail, memory_order_relaxed);
+  for (;;) {
+    log_entry *entry = &L.ring[*pos & (RING_SIZE - 1)];
+    intptr_t diff = (intptr_t)atomic_load_explicit(&entry->seq, memory_order_acquire) - (intptr_t)*pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+            &L.tail, pos, *pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+        return entry;
+      }
+    } else {
+      if (diff < 0) {
+        log_flush();
+      }
+      *pos = atomic_load_explicit(&L.tail, memory_order_relaxed);
+    }
+  }
+}
+
+
 void log_set_udata(void *udata) {
   L.udata = udata;
 }
@@ -73,6 +212,8 @@ void log_set_lock(log_LockFn fn) {
 
 
 void log_set_fp(FILE *fp) {
+  /* Queued messages go to the previous file */
+  log_flush();
   L.fp = fp;
 }
 
@@ -88,49 +229,36 @@ void log_set_quiet(int enable) {
 
 
 void log_log(int level, const char *file, int line, const char *fmt, ...) {
+  va_list args;
+  log_entry *entry;
+  size_t pos;
+  int len;
+
   if (level < L.level) {
     return;
   }
+  pthread_once(&L.started, start);
 
-  /* Acquire lock */
-  lock();
-
-  /* Get current time */
-  time_t t = time(NULL);
-  struct tm *lt = localtime(&t);
-
-  /* Log to stderr */
-  if (!L.quiet) {
-    va_list args;
-    char buf[16];
-    buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
-#ifdef LOG_USE_COLOR
-    fprintf(
-      stderr, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
-      buf, level_colors[level], level_names[level], file, line);
-#else
-    fprintf(stderr, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
-#endif
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-    fflush(stderr);
+  entry = claim_entry(&pos);
+  entry->time = time(NULL);
+  entry->level = level;
+  entry->prefix_len = snprintf(entry->text, ENTRY_TEXT_LEN, "%s:%d: ", file, line);
+  if (entry->prefix_len >= ENTRY_TEXT_LEN) {
+    entry->prefix_len = ENTRY_TEXT_LEN - 1;
   }
-
-  /* Log to file */
-  if (L.fp) {
-    va_list args;
-    char buf[32];
-    buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt)] = '\0';
-    fprintf(L.fp, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
+  va_start(args, fmt);
+  len = vsnprintf(entry->text + entry->prefix_len, ENTRY_TEXT_LEN - entry->prefix_len, fmt, args);
+  va_end(args);
+  if (len >= ENTRY_TEXT_LEN - entry->prefix_len &&
+      (entry->long_text = malloc(entry->prefix_len + len + 1)) != NULL) {
+    memcpy(entry->long_text, entry->text, entry->prefix_len);
     va_start(args, fmt);
-    vfprintf(L.fp, fmt, args);
+    vsnprintf(entry->long_text + entry->prefix_len, len + 1, fmt, args);
     va_end(args);
-    fprintf(L.fp, "\n");
-    fflush(L.fp);
   }
+  atomic_store_explicit(&entry->seq, pos + 1, memory_order_release);
 
-  /* Release lock */
-  unlock();
+  if (level == LOG_FATAL) {
+    log_flush();
+  }
 }
@@ -1,459 +1,2707 @@
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <sqlite3.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <unistd.h>
 #include <curl/curl.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#include "calendar.h"
+#include "checkpoint.h"
+#include "http_cache.h"
 #include "log.h"
+#include "metrics.h"
+#include "price_csv.h"
+#include "price_json.h"
+#include "symbol_table.h"
 
 // General constants
-#define MAX_SYMBOL_LEN 5
-#define MAX_SECURITY_ID_LEN 36
-#define MAX_NUM_LEN 19
+// Longest symbol, in bytes - escaped, it fits in a price URL along with the
+// longest URL format and the requested range
+#define MAX_SYMBOL_LEN 255
+_Static_assert(MAX_SYMBOL_LEN <= METRICS_MAX_SYMBOL_LEN, "symbols must fit in request metrics");
 #define ERROR_MESSAGE_FORMAT "Security price synchronization failed: %s\n"
+#define USAGE_FORMAT "Usage: %s [--backfill] [--incremental] [--pipeline] [--concurrency <n>] [--adaptive] [--epoll] [--price-url <format>] [--cache-ttl <secs>] [--metrics <file>] [--jobs <n>] [--manifest <file>] [--daemon] [--interval <secs>] [--index] [--timeout <secs>] [--retries <n>] [--hedge] [--workers <n>] [--batch <n>] [--batch-url <format>] [--stream] [--memory <MB>] [--resume] [<ibank data dir>...]\n"
 
 // Database constants
 #define ACCOUNTS_DATA_FILE "/accountsData.ibank"
-#define SELECT_SECURITY_SQL "SELECT zuniqueid, zsymbol FROM zsecurity WHERE LENGTH(zsymbol) <= 5"
+#define MANIFEST_COMMENT '#'
+#define HTTP_CACHE_FILE "/ibdq-http-cache.sqlite"
+#define CHECKPOINT_FILE "/ibdq-checkpoint.sqlite"
+#define SELECT_SECURITY_SQL "\
+SELECT zuniqueid, zsymbol FROM zsecurity \
+WHERE LENGTH(zsymbol) BETWEEN 1 AND " TO_STRING(MAX_SYMBOL_LEN)
+// Initial size of the securities array, doubled as needed
+#define SECURITIES_INITIAL_CAPACITY 256
 #define ENT 42
 #define OPT 1
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+// Securities with the date of their latest price, aggregated in one pass over zprice
+#define SELECT_SECURITY_LATEST_PRICE_SQL "\
+SELECT s.zuniqueid, s.zsymbol, p.zlatestdate \
+FROM zsecurity AS s \
+LEFT JOIN (\
+    SELECT zsecurityid, MAX(zdate) AS zlatestdate \
+    FROM zprice \
+    WHERE z_ent = " TO_STRING(ENT) " AND z_opt = " TO_STRING(OPT) " \
+    GROUP BY zsecurityid\
+) AS p ON p.zsecurityid = s.zuniqueid \
+WHERE LENGTH(s.zsymbol) BETWEEN 1 AND " TO_STRING(MAX_SYMBOL_LEN)
 // Apple epoch (2001-01-01) +12 hours
 // Maximizes chances of iBank displaying the same date for all timezones
 #define IBANK_EPOCH 978292800L
+// Rows are staged in a temporary table, and merged into zprice in bulk
+#define CREATE_STAGING_SQL "\
+CREATE TEMP TABLE IF NOT EXISTS price_staging (\
+    zdate TIMESTAMP NOT NULL,\
+    zsecurityid VARCHAR NOT NULL,\
+    zvolume INTEGER,\
+    zclosingprice DECIMAL,\
+    zhighprice DECIMAL,\
+    zlowprice DECIMAL,\
+    zopeningprice DECIMAL,\
+    z_pk INTEGER,\
+    PRIMARY KEY (zsecurityid, zdate)\
+) WITHOUT ROWID"
+#define STAGE_PRICE_SQL "\
+INSERT OR REPLACE INTO price_staging (\
+    zdate, zsecurityid,\
+    zvolume, zclosingprice, zhighprice, zlowprice, zopeningprice\
+) VALUES (\
+    ?, ?, ?, ?, ?, ?, ?\
+)"
+#define STAGE_PRICE_SQL_LEN sizeof(STAGE_PRICE_SQL)
+// Matches staged rows to existing zprice rows in a single pass, so that
+// neither merge statement needs an index on zprice
+#define MATCH_STAGED_PRICE_SQL "\
+UPDATE price_staging \
+SET z_pk = zprice.z_pk \
+FROM zprice \
+WHERE\
+    zprice.z_ent = ?1 AND zprice.z_opt = ?2 AND \
+    zprice.zdate = price_staging.zdate AND zprice.zsecurityid = price_staging.zsecurityid"
+#define MATCH_STAGED_PRICE_SQL_LEN sizeof(MATCH_STAGED_PRICE_SQL)
+// Rewrites only matched rows whose values differ from those stored, so that
+// re-syncing unchanged prices reads zprice, but writes nothing to it
 #define UPDATE_PRICE_SQL "\
 UPDATE zprice \
 SET\
-    zvolume = ?,\
-    zclosingprice = ?,\
-    zhighprice = ?,\
-    zlowprice = ?,\
-    zopeningprice = ? \
-WHERE\
-    z_ent = ? AND z_opt = ? AND \
-    zdate = ? AND zsecurityid = ?"
+    zvolume = s.zvolume,\
+    zclosingprice = s.zclosingprice,\
+    zhighprice = s.zhighprice,\
+    zlowprice = s.zlowprice,\
+    zopeningprice = s.zopeningprice \
+FROM price_staging AS s \
+WHERE zprice.z_pk = s.z_pk AND (\
+    zprice.zvolume IS NOT s.zvolume OR \
+    zprice.zclosingprice IS NOT s.zclosingprice OR \
+    zprice.zhighprice IS NOT s.zhighprice OR \
+    zprice.zlowprice IS NOT s.zlowprice OR \
+    zprice.zopeningprice IS NOT s.zopeningprice\
+)"
 #define UPDATE_PRICE_SQL_LEN sizeof(UPDATE_PRICE_SQL)
 #define INSERT_PRICE_SQL "\
 INSERT INTO zprice (\
     z_ent, z_opt, zdate, zsecurityid,\
     zvolume, zclosingprice, zhighprice, zlowprice, zopeningprice\
-) VALUES (\
-    ?, ?, ?, ?, ?, ?, ?, ?, ?\
-)"
+) \
+SELECT\
+    ?1, ?2, zdate, zsecurityid,\
+    zvolume, zclosingprice, zhighprice, zlowprice, zopeningprice \
+FROM price_staging \
+WHERE z_pk IS NULL"
 #define INSERT_PRICE_SQL_LEN sizeof(INSERT_PRICE_SQL)
+#define CLEAR_STAGING_SQL "DELETE FROM price_staging"
+#define CLEAR_STAGING_SQL_LEN sizeof(CLEAR_STAGING_SQL)
+// Lets staged rows be matched with an index search per row, instead of a
+// scan of zprice per batch (z_pk is the rowid, so the index covers the match)
+#define EXPLAIN_MATCH_STAGED_PRICE_SQL "EXPLAIN QUERY PLAN " MATCH_STAGED_PRICE_SQL
+#define EXPLAIN_DETAIL_COLUMN 3
+#define CREATE_UPSERT_INDEX_SQL "\
+CREATE INDEX IF NOT EXISTS ibdq_price_upsert \
+ON zprice (zsecurityid, zdate, z_ent, z_opt)"
+#define DROP_UPSERT_INDEX_SQL "DROP INDEX IF EXISTS ibdq_price_upsert"
+#define FIND_UPSERT_INDEX_SQL "SELECT 1 FROM sqlite_master WHERE type = 'index' AND name = 'ibdq_price_upsert'"
+#define BEGIN_SQL "BEGIN"
+#define COMMIT_SQL "COMMIT"
+#define ROLLBACK_SQL "ROLLBACK"
+// Reads of the data file are served from a memory map, rather than copied
+// through the page cache, when streaming securities (256MB)
+#define MMAP_SQL "PRAGMA mmap_size = 268435456"
+// Pipelined writer stage
+#define PIPELINE_QUEUE_LEN 1024
+// Writer threads, when syncing several books
+#define WRITER_JOBS 4
+#define MAX_WRITER_JOBS 64
+// Each merge scans zprice, so staged rows are merged in large batches
+#define PIPELINE_BATCH_SIZE 16384
+// Daemon mode - seconds between refreshes, and the longest sleep between checks for signals
+#define DAEMON_INTERVAL 900
+#define DAEMON_NAP_SECS 1
+// Advances z_max to ?3, the z_pk of the last row inserted - new rows are
+// numbered in order, so this is also the largest, and zprice is not aggregated
 #define UPDATE_PK_SQL "\
 UPDATE z_primarykey \
-SET z_max = (SELECT MAX(z_pk) FROM zprice) \
+SET z_max = MAX(z_max, ?1) \
 WHERE z_name = 'Price'"
+#define UPDATE_PK_SQL_LEN sizeof(UPDATE_PK_SQL)
 
 // HTTP constants
 #define HTTP_CONCURRENCY 4
+#define MAX_HTTP_CONCURRENCY 64
+// Download threads, each with its own multi handle and share of the concurrency limit
+#define DOWNLOAD_WORKERS 1
+#define MAX_DOWNLOAD_WORKERS MAX_WRITER_JOBS
+// Rough memory held by libcurl for each transfer, and its connection -
+// receive and TLS buffers, and handle state - counted against the budget
+#define HTTP_REQUEST_MEMORY (64 * 1024)
+#define BYTES_PER_MB (1024 * 1024)
+// Adaptive concurrency - adjusted once per window of completed requests
+#define ADAPTIVE_MIN_WINDOW 4
+// Average latency, relative to the best seen, above which concurrency is reduced
+#define ADAPTIVE_LATENCY_TOLERANCE 1.5
+#define POLL_TIMEOUT_MS 20
+#define EPOLL_MAX_EVENTS 64
+// Per-request timeouts, and retries of throttled (HTTP 429/5xx) or failed requests
+#define HTTP_CONNECT_TIMEOUT_SECS 10L
+#define HTTP_TIMEOUT_SECS 60L
+#define HTTP_RETRIES 2
+#define MAX_HTTP_RETRIES 10
+#define RETRY_BASE_DELAY_SECS 0.5
+#define RETRY_MAX_DELAY_SECS 30.0
+// Hedged requests - duplicated once awaiting a response for longer than this
+// percentile of recent times to first byte
+#define HEDGE_PERCENTILE 0.95
+#define HEDGE_SAMPLES 128
+#define HEDGE_MIN_SAMPLES 20
+// Default price URL - %s is replaced by the symbol
 #define PRICE_URL_FORMAT "https://query1.finance.yahoo.com/v7/finance/download/%s?interval=1d&events=history"
-#define MAX_PRICE_URL_LEN sizeof(PRICE_URL_FORMAT) + MAX_SYMBOL_LEN - 1
-#define CSV_HEADER "Date,Open,High,Low,Close,Adj Close,Volume"
-#define HTTP_DATA_VERIFY_ERR_MSG_FMT "Failed to verify HTTP data - bad CSV header index %d (%d of chunk):\n%s"
+// Default URL of latest prices, as JSON - %s is replaced by a comma-separated list of symbols
+#define BATCH_URL_FORMAT "https://sparc-service.herokuapp.com/js/stock-prices.js?symbols=%s"
+#define BATCH_SYMBOL_SEPARATOR ","
+// Characters of symbols left as they are in URLs - any others are percent-encoded
+#define URL_UNRESERVED_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-._~"
+#define MAX_BATCH_SIZE 500
+#define PRICE_URL_SYMBOL_PLACEHOLDER "%s"
+// Requests a range of history, until now - after a '?', or an '&' when the URL has a query already
+#define PERIOD_URL_PARAMS_FORMAT "%cperiod1=%ld&period2=%ld"
+// Requests only the latest price, instead of a range
+#define PERIOD_LATEST -1L
+#define SECS_PER_DAY 86400L
+#define MAX_PRICE_URL_LEN 2048
+#define HTTP_ETAG_HEADER "ETag:"
+#define HTTP_LAST_MODIFIED_HEADER "Last-Modified:"
+#define HTTP_IF_NONE_MATCH_FORMAT "If-None-Match: %s"
+#define HTTP_IF_MODIFIED_SINCE_FORMAT "If-Modified-Since: %s"
+#define MAX_HTTP_HEADER_LEN (HTTP_CACHE_MAX_VALIDATOR_LEN + 32)
 #define HTTP_DATA_PARSE_ERR_MSG_FMT "Failed to parse %s from HTTP data for %s at index %d:\n%s"
 
-#define LOAD_STATE_VERIFY_HEADER 100
-#define LOAD_STATE_DATE_YEAR 200
-#define LOAD_STATE_DATE_MON 201
-#define LOAD_STATE_DATE_MDAY 202
-#define LOAD_STATE_OPEN 300
-#define LOAD_STATE_HIGH 400
-#define LOAD_STATE_LOW 500
-#define LOAD_STATE_CLOSE 600
-#define LOAD_STATE_ADJCLOSE 700
-#define LOAD_STATE_VOLUME 800
+// Response being parsed, with the position kept in parser
+#define LOAD_STATE_PARSING 100
+#define LOAD_STATE_PERSISTED 1
 #define LOAD_STATE_SUCCESS 0
 #define LOAD_STATE_FAILED -1
 
+static struct {
+    // Stream every row of the price history into zprice
+    bool backfill;
+    // Skip securities whose prices are current, and fetch only missing days for the rest
+    bool incremental;
+    // Persist prices on a writer thread while downloads are in flight
+    bool pipeline;
+    // Maximum concurrent HTTP requests (initial value, when adaptive)
+    int concurrency;
+    // Adjust concurrency to observed latency and throttling
+    bool adaptive;
+    // Drive transfers from an epoll event loop instead of polling
+    bool epoll;
+    // Price URL, with a %s placeholder for the symbol
+    const char *price_url;
+    // Cache responses next to the data file, using them without revalidation for this long
+    long cache_ttl;
+    bool cache;
+    // Timing report written at exit (Prometheus text format if *.prom, JSON otherwise)
+    const char *metrics_path;
+    // File listing data directories, one per line
+    const char *manifest_path;
+    // Books written in parallel
+    int jobs;
+    // Keep running, refreshing every interval seconds, or on SIGHUP
+    bool daemon;
+    long interval;
+    // Index zprice for the life of the process, when upserts would otherwise scan it
+    bool index;
+    // Seconds allowed for each request (0 for no limit), and retries of each security
+    long timeout;
+    int retries;
+    // Duplicate requests awaiting a response for longer than most
+    bool hedge;
+    // Download threads, sharing the concurrency limit
+    int workers;
+    // Symbols whose latest prices are requested together, and the URL they are requested from
+    int batch;
+    const char *batch_url;
+    // Request prices while securities are still being read, with a single book and worker
+    bool stream;
+    // Memory transfers in flight may hold, shared by the workers (0 for no limit)
+    size_t memory_budget;
+    // Journal downloads next to the data file, skipping those completed by an interrupted run
+    bool resume;
+} options = {
+    .concurrency = HTTP_CONCURRENCY, .price_url = PRICE_URL_FORMAT, .jobs = WRITER_JOBS, .interval = DAEMON_INTERVAL,
+    .timeout = HTTP_TIMEOUT_SECS, .retries = HTTP_RETRIES, .workers = DOWNLOAD_WORKERS, .batch = 1,
+    .batch_url = BATCH_URL_FORMAT
+};
+
 typedef struct stock_prices {
-    char security_id[40];
-    char symbol[8];
-    struct tm date;
-    int volume;
-    char close[24];
-    char high[24];
-    char low[24];
-    char open[24];
+    // Interned in the symbol table of the book
+    const char *security_id;
+    const char *symbol;
+    // Latest row parsed
+    price_row row;
     int load_state;
+    // Where prices are requested from, and the securities requested together,
+    // from this one on - set on the first of each request
+    const struct quote_source *source;
+    int batch_len;
+    // Position in the response, allocated only while downloading, so that
+    // securities not in flight cost no more than their row
+    union price_parser *parser;
+    // The response body has started arriving
+    bool receiving;
+    // Start of the requested range (Unix time), or PERIOD_LATEST
+    long period_start;
+    double parse_secs;
+    // Transfer whose response is parsed - when hedged, the first to respond
     CURL *curl;
-    struct stock_prices *next;
+    // Transfers in flight (two, when hedged), and retries so far
+    int requests;
+    int attempts;
+    double retry_at;
+    // Rows have been handed to a writer, so the download can no longer be retried
+    bool emitted;
+    // Response being revalidated against, or recorded into, the HTTP cache
+    struct cached_response *response;
+    // Receives rows as they are downloaded, when streaming
+    struct price_writer *writer;
+    // Syncing several books - the security in each book that holds this symbol
+    struct stock_prices **targets;
+    int target_count;
 } stock_prices;
 
+typedef union price_parser {
+    price_csv csv;
+    price_json json;
+} price_parser;
+
+// Where prices are requested from - the CSV history of one symbol, or the
+// latest prices of a batch of symbols, in JSON
+typedef struct quote_source {
+    // Writes the URL requesting prices for the securities of a request
+    int (*format_url)(char *url, const stock_prices *prices);
+    // Starts, or starts over, parsing a response
+    void (*begin)(stock_prices *prices);
+    // Parses a chunk - body must have room for a terminator at body[len]
+    void (*parse)(stock_prices *prices, char *body, size_t len);
+    // Completes parsing, handing prices to writers when streaming
+    void (*finish)(stock_prices *prices);
+} quote_source;
+
+// Bounded queue feeding a writer thread, shared by the writers of one or more books
+typedef struct price_pipeline {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    stock_prices queue[PIPELINE_QUEUE_LEN];
+    int head;
+    int len;
+    bool closed;
+} price_pipeline;
+
+// Stages rows, and merges them into zprice in a single transaction
+typedef struct price_writer {
+    sqlite3 *db;
+    sqlite3_stmt *stage_stmt;
+    // Merge statements, prepared once, and reused for every batch and refresh
+    sqlite3_stmt *match_stmt;
+    sqlite3_stmt *update_stmt;
+    sqlite3_stmt *insert_stmt;
+    sqlite3_stmt *update_pk_stmt;
+    sqlite3_stmt *clear_stmt;
+    price_pipeline *pipeline;
+    int status;
+    int count;
+    int staged;
+    int updated;
+    int inserted;
+    // Matched rows already holding the downloaded values
+    int unchanged;
+} price_writer;
+
+// A data directory being synchronized
+// Securities are held in one array, grown geometrically while reading
 typedef struct stock_prices_builder {
-    stock_prices *first;
-    stock_prices *last;
+    stock_prices *prices;
     int count;
+    int capacity;
+    // Holds the symbols and ids of the securities read, and counts those
+    // sharing a symbol with one read before
+    symbol_table *symbols;
+    int shared;
+    // Incremental sync - the latest trading day, and whether its prices are final
+    long latest_trading_day;
+    bool latest_trading_day_closed;
+    int skipped;
 } stock_prices_builder;
 
+// Securities read a row at a time, while their prices download
+typedef struct security_cursor {
+    // Prepared once for the life of the process, and reset for each refresh
+    sqlite3_stmt *stmt;
+    stock_prices_builder builder;
+    // Writer of every security read, or NULL when prices are persisted after downloading
+    price_writer *writer;
+    bool done;
+    int status;
+    double read_secs;
+} security_cursor;
+
+typedef struct price_book {
+    const char *data_dir;
+    char *sqlite_file;
+    sqlite3 *db;
+    stock_prices *prices;
+    int count;
+    // Symbols and ids of the securities read, for the current refresh, and
+    // the number sharing a symbol with another
+    symbol_table symbols;
+    int shared;
+    // Securities being read, when streaming
+    security_cursor cursor;
+    price_writer writer;
+    bool writer_open;
+    // A transaction is open for the current refresh
+    bool writing;
+    // Dropped when the book is closed
+    bool created_index;
+    int exit;
+} price_book;
+
+// Cached and received copies of a response, while its request is in flight
+typedef struct cached_response {
+    // Cache key - the price URL, without the requested range
+    char url[MAX_PRICE_URL_LEN];
+    http_cache_entry cached;
+    http_cache_entry received;
+    size_t capacity;
+    struct curl_slist *headers;
+    // Received body outgrew the memory budget, or could not be recorded
+    bool incomplete;
+    size_t limit;
+} cached_response;
+
+static double elapsed_secs(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return end.tv_sec - start->tv_sec + (end.tv_nsec - start->tv_nsec) / 1.0e9;
+}
+
+// Seconds since Apple epoch - 12 hours
+static long ibank_time(struct tm *date) {
+    return mktime(date) - IBANK_EPOCH;
+}
+
+// Days since the Unix epoch of an ibank_time
+static long ibank_day(long ibank_secs) {
+    time_t secs = ibank_secs + IBANK_EPOCH;
+    struct tm date;
+    localtime_r(&secs, &date);
+
+    return calendar_days_from_civil(date.tm_year + 1900, date.tm_mon + 1, date.tm_mday);
+}
+
 static int process_security_select_row_sqlite_cb(void *builder_ptr,
                                                  int cols,
                                                  char **values,
                                                  char **col_names) {
-    if (strlen(values[0]) <= MAX_SECURITY_ID_LEN && strlen(values[1]) <= MAX_SYMBOL_LEN) {
+    // Symbols are limited in characters by the select, and in bytes here
+    if (values[0] != NULL && values[1] != NULL && strlen(values[1]) <= MAX_SYMBOL_LEN) {
         stock_prices_builder *builder = (stock_prices_builder*)builder_ptr;
-        (builder->count)++;
-
-        stock_prices *new_price = malloc(sizeof(stock_prices));
-        new_price->load_state = LOAD_STATE_VERIFY_HEADER;
-        strcpy(new_price->security_id, values[0]);
-        strcpy(new_price->symbol, values[1]);
-        if (builder->last) {
-            builder->last->next = new_price;
-            builder->last = new_price;
-        } else {
-            builder->first = new_price;
-            builder->last = new_price;
+        size_t symbol_count = builder->symbols->count;
+        long period_start = options.backfill ? 0 : PERIOD_LATEST;
+
+        if (options.incremental && cols > 2 && values[2] != NULL) {
+            long latest_day = ibank_day(atol(values[2]));
+            if (latest_day >= builder->latest_trading_day && builder->latest_trading_day_closed) {
+                log_trace("Prices for %s are up to date...", values[1]);
+                builder->skipped++;
+
+                return SQLITE_OK;
+            }
+            // From the latest stored price, which may have been intraday
+            period_start = latest_day * SECS_PER_DAY;
+        }
+        if (builder->count == builder->capacity) {
+            int capacity = builder->capacity ? builder->capacity * 2 : SECURITIES_INITIAL_CAPACITY;
+            stock_prices *prices = realloc(builder->prices, capacity * sizeof(stock_prices));
+            if (prices == NULL) {
+                return SQLITE_NOMEM;
+            }
+            builder->prices = prices;
+            builder->capacity = capacity;
+        }
+
+        stock_prices *new_price = &builder->prices[builder->count];
+        memset(new_price, 0, sizeof(stock_prices));
+        new_price->load_state = LOAD_STATE_PARSING;
+        new_price->period_start = period_start;
+        new_price->symbol = symbol_table_intern(builder->symbols, values[1]);
+        if (new_price->symbol == NULL) {
+            return SQLITE_NOMEM;
         }
+        if (builder->symbols->count == symbol_count) builder->shared++;
+        new_price->security_id = symbol_table_intern(builder->symbols, values[0]);
+        if (new_price->security_id == NULL) {
+            return SQLITE_NOMEM;
+        }
+        builder->count++;
     }
 
     return SQLITE_OK;
 }
 
-static int read_securities(sqlite3 *db, int *count, stock_prices **prices) {
-    stock_prices_builder builder = { NULL, NULL, 0 };
+static void init_stock_prices_builder(stock_prices_builder *builder, symbol_table *symbols) {
+    memset(builder, 0, sizeof(stock_prices_builder));
+    builder->symbols = symbols;
+    if (options.incremental) {
+        int year, month, mday;
+
+        builder->latest_trading_day = calendar_latest_trading_day(time(NULL), &builder->latest_trading_day_closed);
+        calendar_civil_from_days(builder->latest_trading_day, &year, &month, &mday);
+        log_debug("Latest trading day is %04d-%02d-%02d (%s)...", year, month, mday,
+                  builder->latest_trading_day_closed ? "closed" : "open");
+    }
+}
+
+static void log_securities_read(const stock_prices_builder *builder, double secs) {
+    metrics_sql(METRICS_SQL_SELECT_SECURITY, secs);
+    metrics_phase(METRICS_PHASE_READ, secs);
+    log_info("Found %d securities...", builder->count);
+    if (builder->shared > 0) log_info("Found %d securities sharing a symbol with another...", builder->shared);
+    if (options.incremental) log_info("Skipping %d securities already up to date...", builder->skipped);
+    log_debug("Read securities in %.3fs...", secs);
+}
+
+static int read_securities(sqlite3 *db, symbol_table *symbols, int *count, stock_prices **prices, int *shared) {
+    stock_prices_builder builder;
     int sqlite_ret;
     char *sqlite_err;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    sqlite_ret = sqlite3_exec(db, SELECT_SECURITY_SQL,
+    init_stock_prices_builder(&builder, symbols);
+    sqlite_ret = sqlite3_exec(db, options.incremental ? SELECT_SECURITY_LATEST_PRICE_SQL : SELECT_SECURITY_SQL,
                               process_security_select_row_sqlite_cb,
                               &builder, &sqlite_err);
     if (sqlite_ret == SQLITE_OK) {
         *count = builder.count;
-        *prices = builder.first;
-        log_info("Found %d securities...", *count);
+        *prices = builder.prices;
+        *shared = builder.shared;
+        log_securities_read(&builder, elapsed_secs(&start));
 
         return EXIT_SUCCESS;
     } else {
         log_error(ERROR_MESSAGE_FORMAT, sqlite_err);
         sqlite3_free(sqlite_err);
+        free(builder.prices);
 
         return EXIT_FAILURE;
     }
 }
 
-static size_t process_price_request_curl_cb(char *body, size_t n, size_t l, void *price_ptr) {
-    stock_prices *price = (stock_prices*)price_ptr;
-    long http_status;
-    curl_easy_getinfo(price->curl, CURLINFO_RESPONSE_CODE, &http_status);
-
-    if (http_status == 200) {
-        if (price->load_state >= LOAD_STATE_VERIFY_HEADER) {
-            for (int i = 0; i < l; i += n) {
-                if (price->load_state < LOAD_STATE_DATE_YEAR) {
-                    if (price->load_state == LOAD_STATE_VERIFY_HEADER + sizeof(CSV_HEADER) - 1 &&
-                            body[i] == '\n') {
-                        price->load_state = LOAD_STATE_DATE_YEAR;
-                    } else if (price->load_state < LOAD_STATE_VERIFY_HEADER + sizeof(CSV_HEADER) - 1 &&
-                            body[i] == CSV_HEADER[price->load_state - LOAD_STATE_VERIFY_HEADER]) {
-                        price->load_state++;
-                    } else {
-                        body[n*l] = '\0';
-                        log_error(HTTP_DATA_VERIFY_ERR_MSG_FMT, price->load_state - LOAD_STATE_VERIFY_HEADER, i, body);
-                        price->load_state = LOAD_STATE_FAILED;
-                        break;
-                    }
-                } else if (price->load_state == LOAD_STATE_DATE_YEAR) {
-                    if (body[i] == '-') {
-                        price->date.tm_year = price->date.tm_year - 1900;
-                        price->load_state = LOAD_STATE_DATE_MON;
-                    } else if (body[i] >= '0' && body[i] <= '9') {
-                        price->date.tm_year = price->date.tm_year * 10 + body[i] - '0';
-                    } else {
-                        body[n*l] = '\0';
-                        log_error(HTTP_DATA_PARSE_ERR_MSG_FMT, "date.year", price->symbol, i, body);
-                        price->load_state = LOAD_STATE_FAILED;
-                        break;
-                    }
-                } else if (price->load_state == LOAD_STATE_DATE_MON) {
-                    if (body[i] == '-') {
-                        price->date.tm_mon = price->date.tm_mon - 1;
-                        price->load_state = LOAD_STATE_DATE_MDAY;
-                    } else if (body[i] >= '0' && body[i] <= '9') {
-                        price->date.tm_mon = price->date.tm_mon * 10 + body[i] - '0';
-                    } else {
-                        body[n*l] = '\0';
-                        log_error(HTTP_DATA_PARSE_ERR_MSG_FMT, "date.mon", price->symbol, i, body);
-                        price->load_state = LOAD_STATE_FAILED;
-                        break;
-                    }
-                } else if (price->load_state == LOAD_STATE_DATE_MDAY) {
-                    if (body[i] == ',') {
-                        price->load_state = LOAD_STATE_OPEN;
-                    } else if (body[i] >= '0' && body[i] <= '9') {
-                        price->date.tm_mday = price->date.tm_mday * 10 + body[i] - '0';
-                    } else {
-                        body[n*l] = '\0';
-                        log_error(HTTP_DATA_PARSE_ERR_MSG_FMT, "date.mday", price->symbol, i, body);
-                        price->load_state = LOAD_STATE_FAILED;
-                        break;
-                    }
-                } else if (price->load_state < LOAD_STATE_HIGH) {
-                    if (body[i] == ',') {
-                        price->open[price->load_state - LOAD_STATE_OPEN] = '\0';
-                        price->load_state = LOAD_STATE_HIGH;
-                    } else if (price->load_state < LOAD_STATE_OPEN + MAX_NUM_LEN &&
-                               (body[i] == '.' || (body[i] >= '0' && body[i] <= '9'))) {
-                        price->open[price->load_state - LOAD_STATE_OPEN] = body[i];
-                        price->load_state++;
-                    } else {
-                        body[n*l] = '\0';
-                        log_error(HTTP_DATA_PARSE_ERR_MSG_FMT, "open", price->symbol, i, body);
-                        price->load_state = LOAD_STATE_FAILED;
-                        break;
-                    }
-                } else if (price->load_state < LOAD_STATE_LOW) {
-                    if (body[i] == ',') {
-                        price->high[price->load_state - LOAD_STATE_HIGH] = '\0';
-                        price->load_state = LOAD_STATE_LOW;
-                    } else if (price->load_state < LOAD_STATE_HIGH + MAX_NUM_LEN &&
-                               (body[i] == '.' || (body[i] >= '0' && body[i] <= '9'))) {
-                        price->high[price->load_state - LOAD_STATE_HIGH] = body[i];
-                        price->load_state++;
-                    } else {
-                        body[n*l] = '\0';
-                        log_error(HTTP_DATA_PARSE_ERR_MSG_FMT, "high", price->symbol, i, body);
-                        price->load_state = LOAD_STATE_FAILED;
-                        break;
-                    }
-                } else if (price->load_state < LOAD_STATE_CLOSE) {
-                    if (body[i] == ',') {
-                        price->low[price->load_state - LOAD_STATE_LOW] = '\0';
-                        price->load_state = LOAD_STATE_CLOSE;
-                    } else if (price->load_state < LOAD_STATE_LOW + MAX_NUM_LEN &&
-                               (body[i] == '.' || (body[i] >= '0' && body[i] <= '9'))) {
-                        price->low[price->load_state - LOAD_STATE_LOW] = body[i];
-                        price->load_state++;
-                    } else {
-                        body[n*l] = '\0';
-                        log_error(HTTP_DATA_PARSE_ERR_MSG_FMT, "low", price->symbol, i, body);
-                        price->load_state = LOAD_STATE_FAILED;
-                        break;
-                    }
-                } else if (price->load_state < LOAD_STATE_ADJCLOSE) {
-                    if (body[i] == ',') {
-                        price->close[price->load_state - LOAD_STATE_CLOSE] = '\0';
-                        price->load_state = LOAD_STATE_ADJCLOSE;
-                    } else if (price->load_state < LOAD_STATE_CLOSE + MAX_NUM_LEN &&
-                               (body[i] == '.' || (body[i] >= '0' && body[i] <= '9'))) {
-                        price->close[price->load_state - LOAD_STATE_CLOSE] = body[i];
-                        price->load_state++;
-                    } else {
-                        body[n*l] = '\0';
-                        log_error(HTTP_DATA_PARSE_ERR_MSG_FMT, "close", price->symbol, i, body);
-                        price->load_state = LOAD_STATE_FAILED;
-                        break;
-                    }
-                } else if (price->load_state < LOAD_STATE_VOLUME) {
-                    if (body[i] == ',') {
-                        price->load_state = LOAD_STATE_VOLUME;
-                    }
-                } else {
-                    if (body[i] == '\n') {
-                        price->load_state = LOAD_STATE_SUCCESS;
-                        break;
-                    } else if (body[i] >= '0' && body[i] <= '9') {
-                        price->volume = price->volume * 10 + body[i] - '0';
-                    } else {
-                        body[n*l] = '\0';
-                        log_error(HTTP_DATA_PARSE_ERR_MSG_FMT, "volume", price->symbol, i, body);
-                        price->load_state = LOAD_STATE_FAILED;
-                        break;
-                    }
-                }
-            }
+// Starts reading the securities of a book a row at a time, with the
+// statement prepared when it was opened
+static int open_security_cursor(security_cursor *cursor, symbol_table *symbols, price_writer *writer) {
+    free(cursor->builder.prices);
+    init_stock_prices_builder(&cursor->builder, symbols);
+    cursor->builder.prices = malloc(SECURITIES_INITIAL_CAPACITY * sizeof(stock_prices));
+    cursor->builder.capacity = SECURITIES_INITIAL_CAPACITY;
+    cursor->writer = writer;
+    cursor->done = false;
+    cursor->status = EXIT_SUCCESS;
+    cursor->read_secs = 0;
+    sqlite3_reset(cursor->stmt);
+
+    return cursor->builder.prices ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void close_security_cursor(security_cursor *cursor, int status) {
+    sqlite3_reset(cursor->stmt);
+    cursor->done = true;
+    cursor->status = status;
+    if (status == EXIT_SUCCESS) log_securities_read(&cursor->builder, cursor->read_secs);
+}
+
+// Reads the next row, adding its security unless it is skipped - the caller
+// makes room for it first
+static void read_next_security(security_cursor *cursor) {
+    stock_prices_builder *builder = &cursor->builder;
+    double start = metrics_now();
+    int count = builder->count;
+    int sqlite_ret = sqlite3_step(cursor->stmt);
+
+    if (sqlite_ret == SQLITE_ROW) {
+        int cols = sqlite3_column_count(cursor->stmt);
+        char *values[3] = { NULL, NULL, NULL };
+
+        for (int i = 0; i < cols && i < 3; i++) {
+            values[i] = (char*)sqlite3_column_text(cursor->stmt, i);
         }
-    } else {
-        price->load_state = -http_status;
+        if (values[0] != NULL && values[1] != NULL) {
+            process_security_select_row_sqlite_cb(builder, cols, values, NULL);
+        }
+        if (builder->count > count) {
+            builder->prices[count].writer = cursor->writer;
+            if (count == 0) log_debug("Read first security in %.3fs...", metrics_now() - start + cursor->read_secs);
+        }
+    }
+    cursor->read_secs += metrics_now() - start;
+    if (sqlite_ret == SQLITE_DONE) {
+        close_security_cursor(cursor, EXIT_SUCCESS);
+    } else if (sqlite_ret != SQLITE_ROW) {
+        log_error(ERROR_MESSAGE_FORMAT, sqlite3_errmsg(sqlite3_db_handle(cursor->stmt)));
+        close_security_cursor(cursor, EXIT_FAILURE);
     }
+}
 
-    return n*l;
+static int exec_sql(sqlite3 *db, const char *sql) {
+    char *sqlite_err;
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &sqlite_err) != SQLITE_OK) {
+        log_error(ERROR_MESSAGE_FORMAT, sqlite_err);
+        sqlite3_free(sqlite_err);
+
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
 }
 
-static void submit_price_request_curl(CURLM *curl_multi, stock_prices *prices) {
-    log_debug("Downloading prices for %s...", prices->symbol);
-    CURL *curl_easy = curl_easy_init();
-    prices->curl = curl_easy;
-    char *symbol = prices->symbol;
-    char url[MAX_PRICE_URL_LEN];
-    sprintf(url, PRICE_URL_FORMAT, symbol);
-    curl_easy_setopt(curl_easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
-    curl_easy_setopt(curl_easy, CURLOPT_TCP_FASTOPEN, 1L);
-    curl_easy_setopt(curl_easy, CURLOPT_URL, url);
-    curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, process_price_request_curl_cb);
-    curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, prices);
-    curl_multi_add_handle(curl_multi, curl_easy);
+static int exec_timed_sql(sqlite3 *db, const char *sql, int metric) {
+    double start = metrics_now();
+    int ret = exec_sql(db, sql);
+    metrics_sql(metric, metrics_now() - start);
+
+    return ret;
 }
 
-static int enrich_stock_prices(stock_prices *prices) {
-    // Async HTTP calls, largely based on:
-    // https://curl.haxx.se/libcurl/c/10-at-a-time.html
-    CURLM *curl_multi;
-    CURLMsg *msg;
-    int msgs_left = -1;
-    int active_connections = 1;
+// Runs a prepared merge statement, returning the number of rows changed, or -1
+static int exec_merge_stmt(sqlite3 *db, sqlite3_stmt *stmt, int metric) {
+    double start = metrics_now();
+    int sqlite_ret = sqlite3_step(stmt);
 
-    log_trace("Using %s", curl_version());
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl_multi = curl_multi_init();
-    curl_multi_setopt(curl_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)HTTP_CONCURRENCY);
-    curl_multi_setopt(curl_multi, CURLMOPT_PIPELINING, CURLPIPE_HTTP1|CURLPIPE_MULTIPLEX);
+    sqlite3_reset(stmt);
+    metrics_sql(metric, metrics_now() - start);
+    if (sqlite_ret != SQLITE_DONE) {
+        log_error(ERROR_MESSAGE_FORMAT, sqlite3_errmsg(db));
 
-    while (prices != NULL) {
-        submit_price_request_curl(curl_multi, prices);
-        prices = prices->next;
+        return -1;
     }
 
-    do {
-        curl_multi_perform(curl_multi, &active_connections);
-        
-        while ((msg = curl_multi_info_read(curl_multi, &msgs_left))) {
-            if (msg->msg == CURLMSG_DONE) {
-                CURL *curl_easy = msg->easy_handle;
-                curl_multi_remove_handle(curl_multi, curl_easy);
-                curl_easy_cleanup(curl_easy);
-            } else {
-                log_error("HTTP error CURLMsg (%d)\n", msg->msg);
-            }
-        }
-        if (active_connections)
-            curl_multi_wait(curl_multi, NULL, 0, 20, NULL);
-        
-    } while (active_connections);
+    return sqlite3_changes(db);
+}
 
-    curl_multi_cleanup(curl_multi);
-    curl_global_cleanup();
+static int prepare_sql(sqlite3 *db, const char *sql, int sql_len, sqlite3_stmt **stmt) {
+    if (sqlite3_prepare_v2(db, sql, sql_len, stmt, NULL) != SQLITE_OK) {
+        log_error(ERROR_MESSAGE_FORMAT, sqlite3_errmsg(db));
+
+        return EXIT_FAILURE;
+    }
 
     return EXIT_SUCCESS;
 }
 
-// Seconds since Apple epoch - 12 hours
-static long ibank_time(struct tm *date) {
-    return mktime(date) - IBANK_EPOCH;
+// Powers of ten, all exactly representable as doubles
+static const double POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19
+};
+
+// Binds the nearest double, in a single correctly rounded division
+static void bind_price_decimal(sqlite3_stmt *stmt, int index, const price_decimal *decimal) {
+    if (decimal->present) {
+        sqlite3_bind_double(stmt, index, decimal->units / POWERS_OF_TEN[decimal->scale]);
+    } else {
+        sqlite3_bind_null(stmt, index);
+    }
 }
 
-static int persist_stock_prices(sqlite3 *db, stock_prices *prices) {
-    int count = 0;
+static void close_price_writer(price_writer *writer) {
+    sqlite3_finalize(writer->stage_stmt);
+    sqlite3_finalize(writer->match_stmt);
+    sqlite3_finalize(writer->update_stmt);
+    sqlite3_finalize(writer->insert_stmt);
+    sqlite3_finalize(writer->update_pk_stmt);
+    sqlite3_finalize(writer->clear_stmt);
+}
+
+// Creates the staging table, and prepares every statement the writer runs
+static int open_price_writer(sqlite3 *db, price_writer *writer) {
+    memset(writer, 0, sizeof(price_writer));
+    writer->db = db;
+    if (exec_sql(db, CREATE_STAGING_SQL) != EXIT_SUCCESS ||
+            prepare_sql(db, STAGE_PRICE_SQL, STAGE_PRICE_SQL_LEN, &writer->stage_stmt) != EXIT_SUCCESS ||
+            prepare_sql(db, MATCH_STAGED_PRICE_SQL, MATCH_STAGED_PRICE_SQL_LEN, &writer->match_stmt) != EXIT_SUCCESS ||
+            prepare_sql(db, UPDATE_PRICE_SQL, UPDATE_PRICE_SQL_LEN, &writer->update_stmt) != EXIT_SUCCESS ||
+            prepare_sql(db, INSERT_PRICE_SQL, INSERT_PRICE_SQL_LEN, &writer->insert_stmt) != EXIT_SUCCESS ||
+            prepare_sql(db, UPDATE_PK_SQL, UPDATE_PK_SQL_LEN, &writer->update_pk_stmt) != EXIT_SUCCESS ||
+            prepare_sql(db, CLEAR_STAGING_SQL, CLEAR_STAGING_SQL_LEN, &writer->clear_stmt) != EXIT_SUCCESS) {
+        close_price_writer(writer);
+
+        return EXIT_FAILURE;
+    }
+    // Entity and version of price rows, bound once, as they never change
+    sqlite3_bind_int(writer->match_stmt, 1, ENT);
+    sqlite3_bind_int(writer->match_stmt, 2, OPT);
+    sqlite3_bind_int(writer->insert_stmt, 1, ENT);
+    sqlite3_bind_int(writer->insert_stmt, 2, OPT);
+
+    return EXIT_SUCCESS;
+}
+
+static int begin_price_writer(price_writer *writer) {
+    writer->status = EXIT_SUCCESS;
+    writer->count = 0;
+    writer->staged = 0;
+    writer->updated = 0;
+    writer->inserted = 0;
+    writer->unchanged = 0;
+
+    // Deferred, so zprice is not locked until staged rows are merged
+    return exec_sql(writer->db, BEGIN_SQL);
+}
+
+static int stage_stock_price(price_writer *writer, stock_prices *prices) {
+    sqlite3_stmt *stage_stmt = writer->stage_stmt;
+    double start = metrics_now();
     int sqlite_ret;
-    char *sqlite_err;
-    sqlite3_stmt *update_stmt, *insert_stmt;
-
-    sqlite3_prepare_v2(db, UPDATE_PRICE_SQL, UPDATE_PRICE_SQL_LEN, &update_stmt, NULL);
-    sqlite3_prepare_v2(db, INSERT_PRICE_SQL, INSERT_PRICE_SQL_LEN, &insert_stmt, NULL);
-    while (prices != NULL) {
-        if (prices->load_state == LOAD_STATE_SUCCESS || prices->load_state == LOAD_STATE_VOLUME) {
-            sqlite3_bind_int(update_stmt, 1, prices->volume);
-            sqlite3_bind_text(update_stmt, 2, prices->close, -1, SQLITE_STATIC);
-            sqlite3_bind_text(update_stmt, 3, prices->high, -1, SQLITE_STATIC);
-            sqlite3_bind_text(update_stmt, 4, prices->low, -1, SQLITE_STATIC);
-            sqlite3_bind_text(update_stmt, 5, prices->open, -1, SQLITE_STATIC);
-            sqlite3_bind_int(update_stmt, 6, ENT);
-            sqlite3_bind_int(update_stmt, 7, OPT);
-            sqlite3_bind_int64(update_stmt, 8, ibank_time(&prices->date));
-            sqlite3_bind_text(update_stmt, 9, prices->security_id, -1, SQLITE_STATIC);
-            sqlite_ret = sqlite3_step(update_stmt);
-            if (sqlite_ret == SQLITE_DONE) {
-                if (sqlite3_changes(db) > 0) {
-                    count++;
-                    log_debug("Existing entry for %s updated...", prices->symbol);
-                } else {
-                    sqlite3_bind_int(insert_stmt, 1, ENT);
-                    sqlite3_bind_int(insert_stmt, 2, OPT);
-                    sqlite3_bind_int64(insert_stmt, 3, ibank_time(&prices->date));
-                    sqlite3_bind_text(insert_stmt, 4, prices->security_id, -1, SQLITE_STATIC);
-                    sqlite3_bind_int(insert_stmt, 5, prices->volume);
-                    sqlite3_bind_text(insert_stmt, 6, prices->close, -1, SQLITE_STATIC);
-                    sqlite3_bind_text(insert_stmt, 7, prices->high, -1, SQLITE_STATIC);
-                    sqlite3_bind_text(insert_stmt, 8, prices->low, -1, SQLITE_STATIC);
-                    sqlite3_bind_text(insert_stmt, 9, prices->open, -1, SQLITE_STATIC);
-                    sqlite_ret = sqlite3_step(insert_stmt);
-                    if (sqlite_ret == SQLITE_DONE) {
-                        count++;
-                        log_debug("New entry for %s created...", prices->symbol);
-                        sqlite3_reset(insert_stmt);
-                    } else {
-                        log_error("Price insert for %s failed (step code: %d)", prices->symbol, sqlite_ret);
-                    }
-                }
-                sqlite3_reset(update_stmt);
-            } else {
-                log_error("Price update for %s failed (step code: %d)", prices->symbol, sqlite_ret);
+
+    sqlite3_bind_int64(stage_stmt, 1, ibank_time(&prices->row.date));
+    sqlite3_bind_text(stage_stmt, 2, prices->security_id, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stage_stmt, 3, prices->row.volume);
+    bind_price_decimal(stage_stmt, 4, &prices->row.close);
+    bind_price_decimal(stage_stmt, 5, &prices->row.high);
+    bind_price_decimal(stage_stmt, 6, &prices->row.low);
+    bind_price_decimal(stage_stmt, 7, &prices->row.open);
+    sqlite_ret = sqlite3_step(stage_stmt);
+    sqlite3_reset(stage_stmt);
+    metrics_sql(METRICS_SQL_STAGE, metrics_now() - start);
+    if (sqlite_ret != SQLITE_DONE) {
+        log_error("Price staging for %s failed (step code: %d)", prices->symbol, sqlite_ret);
+
+        return EXIT_FAILURE;
+    }
+    writer->count++;
+    writer->staged++;
+    log_trace("Price for %s staged...", prices->symbol);
+
+    return EXIT_SUCCESS;
+}
+
+// Merges all staged rows into zprice, and updates the primary key
+static int merge_staged_prices(price_writer *writer) {
+    sqlite3 *db = writer->db;
+    int matched, updated, inserted;
+
+    if (writer->staged == 0) {
+        return EXIT_SUCCESS;
+    }
+    if ((matched = exec_merge_stmt(db, writer->match_stmt, METRICS_SQL_MATCH)) < 0 ||
+            (updated = exec_merge_stmt(db, writer->update_stmt, METRICS_SQL_UPDATE)) < 0 ||
+            (inserted = exec_merge_stmt(db, writer->insert_stmt, METRICS_SQL_INSERT)) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (inserted > 0) {
+        sqlite3_bind_int64(writer->update_pk_stmt, 1, sqlite3_last_insert_rowid(db));
+        if (exec_merge_stmt(db, writer->update_pk_stmt, METRICS_SQL_UPDATE_PK) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (exec_merge_stmt(db, writer->clear_stmt, METRICS_SQL_CLEAR) < 0) {
+        return EXIT_FAILURE;
+    }
+    writer->staged = 0;
+    writer->updated += updated;
+    writer->inserted += inserted;
+    writer->unchanged += matched - updated;
+    log_debug("Existing entries updated for %d prices...", updated);
+    log_debug("New entries created for %d prices...", inserted);
+    log_debug("Existing entries unchanged for %d prices...", matched - updated);
+    log_debug("Primary key for price updated...");
+
+    return EXIT_SUCCESS;
+}
+
+// Writer thread - stages queued rows, merging them into zprice in batches,
+// so that database work overlaps downloads
+// Each writer is served by one pipeline only, so is never used concurrently
+static void *run_price_pipeline(void *pipeline_ptr) {
+    price_pipeline *pipeline = (price_pipeline*)pipeline_ptr;
+    stock_prices prices;
+
+    pthread_mutex_lock(&pipeline->mutex);
+    while (true) {
+        if (pipeline->len == 0) {
+            if (pipeline->closed) break;
+            pthread_cond_wait(&pipeline->not_empty, &pipeline->mutex);
+            continue;
+        }
+        prices = pipeline->queue[pipeline->head];
+        pipeline->head = (pipeline->head + 1) % PIPELINE_QUEUE_LEN;
+        // Download workers may all be waiting for room
+        if (pipeline->len-- == PIPELINE_QUEUE_LEN) {
+            pthread_cond_broadcast(&pipeline->not_full);
+        }
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        price_writer *writer = prices.writer;
+        if (writer->status == EXIT_SUCCESS) {
+            stage_stock_price(writer, &prices);
+            if (writer->staged >= PIPELINE_BATCH_SIZE && merge_staged_prices(writer) != EXIT_SUCCESS) {
+                writer->status = EXIT_FAILURE;
             }
         }
-        prices = prices->next;
+
+        pthread_mutex_lock(&pipeline->mutex);
     }
+    pthread_mutex_unlock(&pipeline->mutex);
 
-    sqlite_ret = sqlite3_exec(db, UPDATE_PK_SQL,
-                              NULL, NULL, &sqlite_err);
-    if (sqlite_ret == SQLITE_OK) {
-        log_debug("Primary key for price updated...");
-        log_info("Persisted prices for %d securities...", count);
+    return NULL;
+}
 
-        return EXIT_SUCCESS;
-    } else {
-        log_error(ERROR_MESSAGE_FORMAT, sqlite_err);
-        sqlite3_free(sqlite_err);
+static int start_price_pipeline(price_pipeline *pipeline) {
+    memset(pipeline, 0, sizeof(price_pipeline));
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    pthread_cond_init(&pipeline->not_empty, NULL);
+    pthread_cond_init(&pipeline->not_full, NULL);
+    if (pthread_create(&pipeline->thread, NULL, run_price_pipeline, pipeline) != 0) {
+        log_error(ERROR_MESSAGE_FORMAT, "unable to start writer thread");
+        pthread_cond_destroy(&pipeline->not_full);
+        pthread_cond_destroy(&pipeline->not_empty);
+        pthread_mutex_destroy(&pipeline->mutex);
 
         return EXIT_FAILURE;
     }
+    log_debug("Writer thread started...");
+
+    return EXIT_SUCCESS;
 }
 
-static void free_stock_prices(stock_prices *prices) {
-    if (prices->next != NULL) free_stock_prices(prices->next);
-    free(prices);
+// Drains the queue, and waits for the writer thread to finish
+static void stop_price_pipeline(price_pipeline *pipeline) {
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->closed = true;
+    pthread_cond_signal(&pipeline->not_empty);
+    pthread_mutex_unlock(&pipeline->mutex);
+    pthread_join(pipeline->thread, NULL);
+
+    pthread_cond_destroy(&pipeline->not_full);
+    pthread_cond_destroy(&pipeline->not_empty);
+    pthread_mutex_destroy(&pipeline->mutex);
+    log_debug("Writer thread stopped...");
 }
 
-int main(int argc, char **argv) {
-    int exit = EXIT_FAILURE;
+// Hands a row to the writer's thread when pipelining, stages it directly otherwise
+static int write_stock_price(price_writer *writer, stock_prices *prices) {
+    price_pipeline *pipeline = writer->pipeline;
+    stock_prices *queued;
+
+    if (pipeline == NULL) {
+        return stage_stock_price(writer, prices);
+    }
+
+    pthread_mutex_lock(&pipeline->mutex);
+    while (pipeline->len == PIPELINE_QUEUE_LEN) {
+        pthread_cond_wait(&pipeline->not_full, &pipeline->mutex);
+    }
+    queued = &pipeline->queue[(pipeline->head + pipeline->len) % PIPELINE_QUEUE_LEN];
+    *queued = *prices;
+    queued->writer = writer;
+    if (pipeline->len++ == 0) {
+        pthread_cond_signal(&pipeline->not_empty);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    return EXIT_SUCCESS;
+}
+
+// Hands a parsed row to the writer of each book holding the security
+static void emit_stock_price(stock_prices *prices) {
+    prices->emitted = true;
+    if (prices->targets == NULL) {
+        write_stock_price(prices->writer, prices);
+        return;
+    }
+    for (int i = 0; i < prices->target_count; i++) {
+        stock_prices *target = prices->targets[i];
+        target->row = prices->row;
+        write_stock_price(target->writer, target);
+    }
+}
+
+// Merges and commits staged rows when commit is true, rolls back otherwise
+static int end_price_writer(price_writer *writer, bool commit) {
     struct timespec start;
     clock_gettime(CLOCK_MONOTONIC, &start);
 
-    if (argc == 2) {
-        stock_prices *prices = NULL;
-        int read_count = 0;
-        char *ibank_data_dir;
-        char *sqlite_file;
-        sqlite3 *db;
-        int sqlite_ret;
+    if (commit &&
+            merge_staged_prices(writer) == EXIT_SUCCESS &&
+            exec_timed_sql(writer->db, COMMIT_SQL, METRICS_SQL_COMMIT) == EXIT_SUCCESS) {
+        metrics_phase(METRICS_PHASE_COMMIT, elapsed_secs(&start));
+        log_debug("Merged and committed prices in %.3fs...", elapsed_secs(&start));
+        log_debug("Existing entries updated for %d prices in total...", writer->updated);
+        log_debug("New entries created for %d prices in total...", writer->inserted);
+        log_debug("Existing entries unchanged for %d prices in total...", writer->unchanged);
+        log_info("Persisted %d prices...", writer->count);
 
-        log_set_level(LOG_DEBUG);
-        log_set_quiet(true); // Don't log to stderr
-        log_set_fp(stdout);
-        ibank_data_dir = argv[1];
-        sqlite_file = malloc(strlen(ibank_data_dir) + sizeof(ACCOUNTS_DATA_FILE));
-        strcpy(sqlite_file, ibank_data_dir);
-        strcat(sqlite_file, ACCOUNTS_DATA_FILE);
-        log_info("Processing SQLite file %s...", sqlite_file);
-        sqlite_ret = sqlite3_open(sqlite_file, &db);
-        if (sqlite_ret == SQLITE_OK) {
-            if (read_securities(db, &read_count, &prices) == EXIT_SUCCESS) {
-                if (enrich_stock_prices(prices) == EXIT_SUCCESS) {
-                    if (persist_stock_prices(db, prices) == EXIT_SUCCESS) {
-                        exit = EXIT_SUCCESS;
-                    }
-                }
+        return EXIT_SUCCESS;
+    }
+    exec_sql(writer->db, ROLLBACK_SQL);
 
-                free_stock_prices(prices);
-            }
-        } else {
-            log_error(ERROR_MESSAGE_FORMAT, sqlite3_errmsg(db));
+    return commit ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Journal of completed downloads, when resuming
+static checkpoint *journal = NULL;
+
+// Receives each row of a download, parsed or replayed from the journal
+static bool accept_price_row(void *prices_ptr, price_row *row) {
+    stock_prices *prices = (stock_prices*)prices_ptr;
+
+    prices->row = *row;
+    if (prices->period_start != PERIOD_LATEST) {
+        // Downloading a range - persist this row and carry on with the next
+        emit_stock_price(prices);
+        return true;
+    }
+    prices->load_state = LOAD_STATE_SUCCESS;
+
+    return false;
+}
+
+// Receives each row parsed from a download, journaling rows of a range as they arrive
+static bool handle_price_row(void *prices_ptr, price_row *row) {
+    stock_prices *prices = (stock_prices*)prices_ptr;
+
+    if (journal && prices->period_start != PERIOD_LATEST &&
+            checkpoint_add_row(journal, prices->symbol, prices->period_start, row) != 0) {
+        log_warn("Failed to journal prices for %s...", prices->symbol);
+    }
+
+    return accept_price_row(prices, row);
+}
+
+// Parses a chunk of CSV - body must have room for a terminator at body[len]
+static void parse_price_history(stock_prices *price, char *body, size_t len) {
+    if (price->load_state == LOAD_STATE_PARSING &&
+            price_csv_parse(&price->parser->csv, body, len, handle_price_row, price) == PRICE_CSV_ERROR) {
+        body[len] = '\0';
+        log_error(HTTP_DATA_PARSE_ERR_MSG_FMT, price->parser->csv.error, price->symbol,
+                  (int)price->parser->csv.error_index, body);
+        price->load_state = LOAD_STATE_FAILED;
+    }
+}
+
+// Receives the latest price of a symbol in a batch, ignoring symbols not
+// requested
+static bool handle_batch_price(void *prices_ptr, const char *symbol, price_row *row) {
+    stock_prices *prices = (stock_prices*)prices_ptr;
+
+    for (stock_prices *member = prices; member < prices + prices->batch_len; member++) {
+        if (strcmp(member->symbol, symbol) == 0) {
+            member->row = *row;
+            member->load_state = LOAD_STATE_SUCCESS;
+        }
+    }
+
+    return true;
+}
+
+// Parses a chunk of a batch in JSON - body must have room for a terminator at body[len]
+static void parse_price_batch(stock_prices *prices, char *body, size_t len) {
+    if (prices->load_state >= LOAD_STATE_SUCCESS &&
+            price_json_parse(&prices->parser->json, body, len, handle_batch_price, prices) == PRICE_JSON_ERROR) {
+        body[len] = '\0';
+        log_error(HTTP_DATA_PARSE_ERR_MSG_FMT, prices->parser->json.error, prices->symbol,
+                  (int)prices->parser->json.error_index, body);
+    }
+}
+
+static void parse_stock_prices(stock_prices *prices, char *body, size_t len) {
+    double start = metrics_enabled() ? metrics_now() : 0;
+
+    prices->source->parse(prices, body, len);
+    if (metrics_enabled()) prices->parse_secs += metrics_now() - start;
+}
+
+// Appends a chunk to the response to be cached
+static void record_response_chunk(cached_response *response, const char *body, size_t len) {
+    http_cache_entry *received = &response->received;
+
+    if (response->incomplete) {
+        return;
+    }
+    if (received->len + len + 1 > response->capacity) {
+        size_t capacity = response->capacity ? response->capacity : 4096;
+        while (received->len + len + 1 > capacity) capacity *= 2;
+        char *grown = response->limit && capacity > response->limit ? NULL : realloc(received->body, capacity);
+        if (grown == NULL) {
+            // Parsed all the same, but not cached
+            response->incomplete = true;
+            return;
+        }
+        received->body = grown;
+        response->capacity = capacity;
+    }
+    memcpy(received->body + received->len, body, len);
+    received->len += len;
+    received->body[received->len] = '\0';
+}
+
+// A transfer in flight, one per pooled easy handle
+typedef struct price_request {
+    CURL *curl;
+    stock_prices *prices;
+    double started;
+    // Has a hedged duplicate, or is one
+    bool hedged;
+} price_request;
+
+static size_t process_price_request_curl_cb(char *body, size_t n, size_t l, void *request_ptr) {
+    price_request *request = (price_request*)request_ptr;
+    stock_prices *price = request->prices;
+
+    if (price->curl != request->curl) {
+        return 0;
+    }
+    // The status is checked on the first chunk only - later chunks of a
+    // non-200 response find a negative load_state
+    if (!price->receiving) {
+        long http_status;
+        curl_easy_getinfo(price->curl, CURLINFO_RESPONSE_CODE, &http_status);
+        if (http_status != 200) price->load_state = -http_status;
+        price->receiving = true;
+    }
+    if (price->load_state >= LOAD_STATE_SUCCESS) {
+        if (price->response) record_response_chunk(price->response, body, n*l);
+        parse_stock_prices(price, body, n*l);
+    }
+
+    return n*l;
+}
+
+// Claims the response for the first transfer to respond, when hedged, and
+// captures validators for the HTTP cache
+static size_t process_price_header_curl_cb(char *header, size_t n, size_t l, void *request_ptr) {
+    price_request *request = (price_request*)request_ptr;
+    stock_prices *price = request->prices;
+    size_t len = n*l;
+    char *dest = NULL;
+    size_t name_len = 0;
+
+    if (price->curl == NULL) {
+        price->curl = request->curl;
+    } else if (price->curl != request->curl) {
+        // Aborts the slower transfer
+        return 0;
+    }
+    if (price->response == NULL) {
+        return len;
+    }
+    if (len > sizeof(HTTP_ETAG_HEADER) - 1 &&
+            strncasecmp(header, HTTP_ETAG_HEADER, sizeof(HTTP_ETAG_HEADER) - 1) == 0) {
+        dest = price->response->received.etag;
+        name_len = sizeof(HTTP_ETAG_HEADER) - 1;
+    } else if (len > sizeof(HTTP_LAST_MODIFIED_HEADER) - 1 &&
+            strncasecmp(header, HTTP_LAST_MODIFIED_HEADER, sizeof(HTTP_LAST_MODIFIED_HEADER) - 1) == 0) {
+        dest = price->response->received.last_modified;
+        name_len = sizeof(HTTP_LAST_MODIFIED_HEADER) - 1;
+    }
+    if (dest) {
+        const char *value = header + name_len;
+        size_t value_len = len - name_len;
+        while (value_len > 0 && (*value == ' ' || *value == '\t')) {
+            value++;
+            value_len--;
+        }
+        while (value_len > 0 && (value[value_len - 1] == '\r' || value[value_len - 1] == '\n' ||
+                                 value[value_len - 1] == ' ')) {
+            value_len--;
         }
+        if (value_len < HTTP_CACHE_MAX_VALIDATOR_LEN) {
+            memcpy(dest, value, value_len);
+            dest[value_len] = '\0';
+        }
+    }
+
+    return len;
+}
 
-        sqlite3_close(db);
-        free(sqlite_file);
+// Hands the price of a completed download to the writer, when streaming to one
+static void complete_stock_prices(stock_prices *prices) {
+    if ((prices->writer || prices->targets) && prices->load_state == LOAD_STATE_SUCCESS) {
+        emit_stock_price(prices);
+        prices->load_state = LOAD_STATE_PERSISTED;
+    }
+    // Books holding the security share the outcome of its download
+    for (int i = 0; i < prices->target_count; i++) {
+        prices->targets[i]->load_state = prices->load_state;
+    }
+}
+
+static void free_price_parser(stock_prices *prices) {
+    free(prices->parser);
+    prices->parser = NULL;
+}
+
+// The final row may not end with a newline
+static void finish_price_history(stock_prices *prices) {
+    if (prices->load_state == LOAD_STATE_PARSING &&
+            price_csv_finish(&prices->parser->csv, handle_price_row, prices) && prices->period_start != PERIOD_LATEST) {
+        prices->load_state = LOAD_STATE_PERSISTED;
+    }
+    free_price_parser(prices);
+    complete_stock_prices(prices);
+}
 
-        if (exit == EXIT_SUCCESS) {
-            struct timespec end;
-            clock_gettime(CLOCK_MONOTONIC, &end);
-            double elapsed_secs =
-                end.tv_sec - start.tv_sec +
-                (end.tv_nsec - start.tv_nsec) / 1.0e9;
-            log_info("Security prices synchronized in %.3fs.", elapsed_secs);
+// Fails the whole batch if the response was not JSON, or was cut short
+static void finish_price_batch(stock_prices *prices) {
+    bool parsed = prices->load_state >= LOAD_STATE_SUCCESS && price_json_finish(&prices->parser->json);
+
+    free_price_parser(prices);
+
+    for (stock_prices *member = prices; member < prices + prices->batch_len; member++) {
+        if (!parsed && member->load_state >= LOAD_STATE_SUCCESS) {
+            member->load_state = LOAD_STATE_FAILED;
+        } else if (parsed && member->load_state == LOAD_STATE_PARSING) {
+            log_debug("No price for %s in batch...", member->symbol);
+        }
+        complete_stock_prices(member);
+    }
+}
+
+// Marks the securities of a request complete in the journal, with the latest
+// price, when requested
+static void journal_stock_prices(stock_prices *prices) {
+    for (stock_prices *member = prices; member < prices + prices->batch_len; member++) {
+        if (member->load_state != LOAD_STATE_SUCCESS && member->load_state != LOAD_STATE_PERSISTED) continue;
+        if ((member->period_start == PERIOD_LATEST &&
+                checkpoint_add_row(journal, member->symbol, member->period_start, &member->row) != 0) ||
+                checkpoint_complete(journal, member->symbol, member->period_start) != 0) {
+            log_warn("Failed to journal prices for %s...", member->symbol);
         }
+    }
+}
+
+static void finish_stock_prices(stock_prices *prices) {
+    prices->source->finish(prices);
+    if (journal) journal_stock_prices(prices);
+}
+
+// Completes the download of a security from the journal, when an interrupted
+// run completed it, returning true
+static bool resume_stock_prices(stock_prices *prices) {
+    prices->load_state = LOAD_STATE_PARSING;
+    if (!checkpoint_replay(journal, prices->symbol, prices->period_start, accept_price_row, prices)) {
+        return false;
+    }
+    if (prices->period_start != PERIOD_LATEST) prices->load_state = LOAD_STATE_PERSISTED;
+    log_debug("Resumed prices for %s from checkpoint...", prices->symbol);
+    complete_stock_prices(prices);
+
+    return true;
+}
+
+// DNS cache and TLS sessions, shared by the clients of every download worker
+typedef struct http_share {
+    CURLSH *share;
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+} http_share;
+
+static void lock_http_share_cb(CURL *curl_easy, curl_lock_data data, curl_lock_access access, void *share_ptr) {
+    pthread_mutex_lock(&((http_share*)share_ptr)->locks[data]);
+}
+
+static void unlock_http_share_cb(CURL *curl_easy, curl_lock_data data, void *share_ptr) {
+    pthread_mutex_unlock(&((http_share*)share_ptr)->locks[data]);
+}
+
+static void init_http_share(http_share *share) {
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&share->locks[i], NULL);
+    }
+    share->share = curl_share_init();
+    curl_share_setopt(share->share, CURLSHOPT_LOCKFUNC, lock_http_share_cb);
+    curl_share_setopt(share->share, CURLSHOPT_UNLOCKFUNC, unlock_http_share_cb);
+    curl_share_setopt(share->share, CURLSHOPT_USERDATA, share);
+    curl_share_setopt(share->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+static void cleanup_http_share(http_share *share) {
+    curl_share_cleanup(share->share);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&share->locks[i]);
+    }
+}
+
+// HTTP client state, one per download worker - pooled easy handles, reusing
+// the connections of the multi handle, and the (possibly adaptive) limit on
+// requests in flight
+typedef struct http_client {
+    CURLM *multi;
+    CURLSH *share;
+    // Persistent response cache, or NULL
+    http_cache *cache;
+    price_request *idle[MAX_HTTP_CONCURRENCY];
+    int idle_count;
+    // Securities yet to be requested
+    stock_prices *pending;
+    stock_prices *end;
+    // Securities still being read, appended at end as needed, when streaming
+    security_cursor *cursor;
+    int limit;
+    // Share of MAX_HTTP_CONCURRENCY, when adaptive
+    int max_limit;
+    // Share of the memory budget, or 0
+    size_t memory_budget;
+    int in_flight;
+    price_request *active[MAX_HTTP_CONCURRENCY];
+    // Securities awaiting another attempt
+    stock_prices **retries;
+    int retry_count;
+    int retry_capacity;
+    // Recent times to first byte, and the time after which requests are hedged
+    double ttfb_samples[HEDGE_SAMPLES];
+    int ttfb_count;
+    double hedge_after;
+    // Adaptive concurrency window
+    int window_completed;
+    int window_throttled;
+    double window_latency;
+    double best_latency;
+#ifdef HAVE_EPOLL
+    int epoll_fd;
+    // Deadline requested by libcurl's timer callback, in ms (-1 if none)
+    long timeout_ms;
+    struct timespec timeout_set;
+#endif
+} http_client;
+
+// Share of total for worker index, of workers - their shares sum to total
+static int worker_share(int total, int workers, int index) {
+    return total / workers + (index < total % workers);
+}
+
+static void init_http_client(http_client *client, http_cache *cache, http_share *share, int index) {
+    memset(client, 0, sizeof(http_client));
+    client->limit = worker_share(options.concurrency, options.workers, index);
+    client->max_limit = worker_share(MAX_HTTP_CONCURRENCY, options.workers, index);
+    client->memory_budget = options.memory_budget / options.workers;
+    client->cache = cache;
+    client->share = share->share;
+    client->multi = curl_multi_init();
+    curl_multi_setopt(client->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)client->limit);
+    curl_multi_setopt(client->multi, CURLMOPT_PIPELINING, CURLPIPE_HTTP1|CURLPIPE_MULTIPLEX);
+}
+
+static void free_price_request(price_request *request) {
+    curl_easy_cleanup(request->curl);
+    free(request);
+}
+
+static void cleanup_http_client(http_client *client) {
+    while (client->idle_count > 0) {
+        free_price_request(client->idle[--client->idle_count]);
+    }
+    free(client->retries);
+    curl_multi_cleanup(client->multi);
+}
+
+// Takes an easy handle from the pool, creating one if none are idle
+static price_request *acquire_price_request(http_client *client) {
+    if (client->idle_count > 0) {
+        return client->idle[--client->idle_count];
+    }
+
+    price_request *request = calloc(1, sizeof(price_request));
+    CURL *curl_easy = curl_easy_init();
+    request->curl = curl_easy;
+    curl_easy_setopt(curl_easy, CURLOPT_SHARE, client->share);
+    curl_easy_setopt(curl_easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl_easy, CURLOPT_TCP_FASTOPEN, 1L);
+    curl_easy_setopt(curl_easy, CURLOPT_CONNECTTIMEOUT, options.timeout > 0 && options.timeout < HTTP_CONNECT_TIMEOUT_SECS ?
+                                                        options.timeout : HTTP_CONNECT_TIMEOUT_SECS);
+    curl_easy_setopt(curl_easy, CURLOPT_TIMEOUT, options.timeout);
+    curl_easy_setopt(curl_easy, CURLOPT_WRITEFUNCTION, process_price_request_curl_cb);
+    curl_easy_setopt(curl_easy, CURLOPT_WRITEDATA, request);
+    curl_easy_setopt(curl_easy, CURLOPT_HEADERFUNCTION, process_price_header_curl_cb);
+    curl_easy_setopt(curl_easy, CURLOPT_HEADERDATA, request);
+    curl_easy_setopt(curl_easy, CURLOPT_PRIVATE, request);
+
+    return request;
+}
+
+static void release_price_request(http_client *client, price_request *request) {
+    curl_multi_remove_handle(client->multi, request->curl);
+    for (int i = 0; i < client->in_flight; i++) {
+        if (client->active[i] == request) {
+            client->active[i] = client->active[--client->in_flight];
+            break;
+        }
+    }
+    request->prices->requests--;
+    if (client->idle_count < MAX_HTTP_CONCURRENCY) {
+        client->idle[client->idle_count++] = request;
+    } else {
+        free_price_request(request);
+    }
+}
+
+// Additive increase, multiplicative decrease - halves the limit when
+// throttled (HTTP 429/5xx or transport errors), decrements it when latency
+// degrades, and otherwise probes for more throughput
+static void adapt_http_concurrency(http_client *client, CURL *curl_easy, CURLcode result) {
+    long http_status = 0;
+    double latency = 0;
+    int window = client->limit > ADAPTIVE_MIN_WINDOW ? client->limit : ADAPTIVE_MIN_WINDOW;
+    int limit = client->limit;
+
+    curl_easy_getinfo(curl_easy, CURLINFO_RESPONSE_CODE, &http_status);
+    curl_easy_getinfo(curl_easy, CURLINFO_TOTAL_TIME, &latency);
+    client->window_completed++;
+    client->window_latency += latency;
+    if (result != CURLE_OK || http_status == 429 || http_status >= 500) {
+        client->window_throttled++;
+    }
+    if (client->window_completed < window) {
+        return;
+    }
+
+    double avg_latency = client->window_latency / client->window_completed;
+    if (client->best_latency == 0 || avg_latency < client->best_latency) {
+        client->best_latency = avg_latency;
+    }
+    if (client->window_throttled > 0) {
+        limit = limit / 2;
+    } else if (avg_latency > client->best_latency * ADAPTIVE_LATENCY_TOLERANCE) {
+        limit--;
+    } else {
+        limit++;
+    }
+    if (limit < 1) limit = 1;
+    if (limit > client->max_limit) limit = client->max_limit;
+    if (limit != client->limit) {
+        log_debug("Adjusting HTTP concurrency to %d (%d of %d throttled, %.3fs average latency)...",
+                  limit, client->window_throttled, client->window_completed, avg_latency);
+        client->limit = limit;
+        curl_multi_setopt(client->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)limit);
+    }
+    client->window_completed = 0;
+    client->window_throttled = 0;
+    client->window_latency = 0;
+}
+
+// Length of a symbol once percent-encoded, e.g. ^GSPC as %5EGSPC
+static size_t escaped_symbol_len(const char *symbol) {
+    size_t len = 0;
+
+    for (const char *c = symbol; *c; c++) {
+        len += strchr(URL_UNRESERVED_CHARS, *c) ? 1 : 3;
+    }
+
+    return len;
+}
+
+// Appends a symbol to a URL, percent-encoding characters other than the
+// unreserved ones - the URL has room for it, symbols being at most
+// MAX_SYMBOL_LEN
+static int append_escaped_symbol(char *url, int url_len, const char *symbol) {
+    static const char HEX_DIGITS[] = "0123456789ABCDEF";
+
+    for (const unsigned char *c = (const unsigned char*)symbol; *c; c++) {
+        if (strchr(URL_UNRESERVED_CHARS, *c)) {
+            url[url_len++] = (char)*c;
+        } else {
+            url[url_len++] = '%';
+            url[url_len++] = HEX_DIGITS[*c >> 4];
+            url[url_len++] = HEX_DIGITS[*c & 0xf];
+        }
+    }
+    url[url_len] = '\0';
+
+    return url_len;
+}
+
+// Substitutes symbol into the price URL, without treating the URL as a printf
+// format, as it may contain percent-encoded characters
+static int format_price_url(char *url, const stock_prices *prices) {
+    const char *placeholder = strstr(options.price_url, PRICE_URL_SYMBOL_PLACEHOLDER);
+    int url_len = snprintf(url, MAX_PRICE_URL_LEN, "%.*s", (int)(placeholder - options.price_url), options.price_url);
+
+    url_len = append_escaped_symbol(url, url_len, prices->symbol);
+
+    return url_len + snprintf(url + url_len, MAX_PRICE_URL_LEN - url_len, "%s",
+                              placeholder + sizeof(PRICE_URL_SYMBOL_PLACEHOLDER) - 1);
+}
+
+// Substitutes the symbols of the batch into the batch URL - batches are
+// sized to fit in MAX_PRICE_URL_LEN
+static int format_batch_url(char *url, const stock_prices *prices) {
+    const char *placeholder = strstr(options.batch_url, PRICE_URL_SYMBOL_PLACEHOLDER);
+    int url_len = snprintf(url, MAX_PRICE_URL_LEN, "%.*s", (int)(placeholder - options.batch_url), options.batch_url);
+
+    for (int i = 0; i < prices->batch_len; i++) {
+        if (i > 0) url_len += snprintf(url + url_len, MAX_PRICE_URL_LEN - url_len, "%s", BATCH_SYMBOL_SEPARATOR);
+        url_len = append_escaped_symbol(url, url_len, prices[i].symbol);
+    }
+
+    return url_len + snprintf(url + url_len, MAX_PRICE_URL_LEN - url_len, "%s",
+                              placeholder + sizeof(PRICE_URL_SYMBOL_PLACEHOLDER) - 1);
+}
+
+// Allocates the parser on the first attempt, failing the download should that fail
+static bool alloc_price_parser(stock_prices *prices) {
+    if (prices->parser == NULL) prices->parser = malloc(sizeof(price_parser));
+
+    return prices->parser != NULL;
+}
+
+static void begin_price_history(stock_prices *prices) {
+    prices->load_state = alloc_price_parser(prices) ? LOAD_STATE_PARSING : LOAD_STATE_FAILED;
+    prices->receiving = false;
+    if (prices->parser) price_csv_init(&prices->parser->csv);
+}
+
+static void begin_price_batch(stock_prices *prices) {
+    int load_state = alloc_price_parser(prices) ? LOAD_STATE_PARSING : LOAD_STATE_FAILED;
+
+    for (stock_prices *member = prices; member < prices + prices->batch_len; member++) {
+        member->load_state = load_state;
+    }
+    prices->receiving = false;
+    if (prices->parser) price_json_init(&prices->parser->json);
+}
+
+static const quote_source history_source = {
+    format_price_url, begin_price_history, parse_price_history, finish_price_history
+};
+static const quote_source batch_source = {
+    format_batch_url, begin_price_batch, parse_price_batch, finish_price_batch
+};
+
+// Wants only its latest price, and has a symbol that can be told apart from
+// the others in a batch request, and matched in its response
+static bool is_batchable(const stock_prices *prices) {
+    return prices->period_start == PERIOD_LATEST && strlen(prices->symbol) <= PRICE_JSON_MAX_TOKEN_LEN &&
+           strstr(prices->symbol, BATCH_SYMBOL_SEPARATOR) == NULL;
+}
+
+// Takes the securities of the next request from those pending - as many as
+// fit in a batch, of those wanting their latest price, when batching
+static stock_prices *take_pending_prices(http_client *client) {
+    stock_prices *prices = client->pending++;
+    size_t url_len = strlen(options.batch_url) + escaped_symbol_len(prices->symbol);
+
+    prices->source = &history_source;
+    prices->batch_len = 1;
+    if (options.batch > 1 && is_batchable(prices)) {
+        prices->source = &batch_source;
+        while (prices->batch_len < options.batch && client->pending < client->end &&
+               is_batchable(client->pending) &&
+               (url_len += escaped_symbol_len(client->pending->symbol) + 1) < MAX_PRICE_URL_LEN) {
+            client->pending++;
+            prices->batch_len++;
+        }
+    }
+    prices->source->begin(prices);
+
+    return prices;
+}
+
+static void free_cached_response(stock_prices *prices) {
+    cached_response *response = prices->response;
+
+    curl_slist_free_all(response->headers);
+    http_cache_entry_free(&response->cached);
+    http_cache_entry_free(&response->received);
+    free(response);
+    prices->response = NULL;
+}
+
+// Serves prices from the cache while fresh, returning true, otherwise
+// prepares a conditional request, when a cached response exists
+static bool lookup_cached_response(http_client *client, stock_prices *prices, const char *url) {
+    cached_response *response = calloc(1, sizeof(cached_response));
+    char header[MAX_HTTP_HEADER_LEN];
+
+    prices->response = response;
+    response->limit = client->memory_budget;
+    strcpy(response->url, url);
+    if (!http_cache_lookup(client->cache, url, prices->period_start, &response->cached)) {
+        return false;
+    }
+    if (http_cache_is_fresh(client->cache, &response->cached)) {
+        log_debug("Using cached prices for %s...", prices->symbol);
+        parse_stock_prices(prices, response->cached.body, response->cached.len);
+        finish_stock_prices(prices);
+        free_cached_response(prices);
+
+        return true;
+    }
+    if (response->cached.etag[0]) {
+        snprintf(header, sizeof(header), HTTP_IF_NONE_MATCH_FORMAT, response->cached.etag);
+        response->headers = curl_slist_append(response->headers, header);
+    }
+    if (response->cached.last_modified[0]) {
+        snprintf(header, sizeof(header), HTTP_IF_MODIFIED_SINCE_FORMAT, response->cached.last_modified);
+        response->headers = curl_slist_append(response->headers, header);
+    }
+
+    return false;
+}
+
+// Replays the cached response when revalidated, and caches a new one
+// when it was parsed successfully
+static void finish_cached_response(http_client *client, stock_prices *prices, long http_status) {
+    cached_response *response = prices->response;
+
+    if (http_status == 304 && response->cached.body) {
+        log_debug("Revalidated cached prices for %s...", prices->symbol);
+        parse_stock_prices(prices, response->cached.body, response->cached.len);
+        http_cache_touch(client->cache, response->url, prices->period_start);
+    } else if (http_status == 200 && prices->load_state >= LOAD_STATE_SUCCESS && response->incomplete) {
+        log_debug("Not caching prices for %s, beyond the memory budget...", prices->symbol);
+    } else if (http_status == 200 && prices->load_state >= LOAD_STATE_SUCCESS) {
+        response->received.fetched_at = (long)time(NULL);
+        if (http_cache_store(client->cache, response->url, prices->period_start, &response->received) != 0) {
+            log_warn("Failed to cache prices for %s...", prices->symbol);
+        }
+    }
+    free_cached_response(prices);
+}
+
+static void start_price_request(http_client *client, stock_prices *prices, const char *url, bool hedged) {
+    price_request *request = acquire_price_request(client);
+
+    request->prices = prices;
+    request->started = metrics_now();
+    request->hedged = hedged;
+    curl_easy_setopt(request->curl, CURLOPT_URL, url);
+    curl_easy_setopt(request->curl, CURLOPT_HTTPHEADER, prices->response ? prices->response->headers : NULL);
+    curl_multi_add_handle(client->multi, request->curl);
+    client->active[client->in_flight++] = request;
+    prices->requests++;
+}
+
+static void submit_price_request_curl(http_client *client, stock_prices *prices) {
+    char url[MAX_PRICE_URL_LEN];
+    int url_len = prices->source->format_url(url, prices);
+    // Retries keep the cached response, if any, they were revalidating
+    if (client->cache && prices->attempts == 0 && lookup_cached_response(client, prices, url)) {
+        return;
+    }
+
+    if (prices->attempts == 0 && prices->batch_len > 1) {
+        log_debug("Downloading prices for %s and %d more...", prices->symbol, prices->batch_len - 1);
+    } else if (prices->attempts == 0) {
+        log_debug("Downloading prices for %s...", prices->symbol);
+    } else {
+        log_debug("Downloading prices for %s (retry %d)...", prices->symbol, prices->attempts);
+    }
+    prices->curl = NULL;
+    if (prices->period_start != PERIOD_LATEST) {
+        snprintf(url + url_len, MAX_PRICE_URL_LEN - url_len, PERIOD_URL_PARAMS_FORMAT,
+                 strchr(url, '?') ? '&' : '?', prices->period_start, (long)time(NULL));
+    }
+    start_price_request(client, prices, url, false);
+}
+
+// Submits retries that are due, then pending requests, up to the concurrency
+// limit, so that finished handles can be reused for the next symbol
+// Moves the securities read so far to an array twice the size, while some
+// are in flight, along with every reference the client holds to them
+static bool grow_streamed_securities(http_client *client) {
+    stock_prices_builder *builder = &client->cursor->builder;
+    int capacity = builder->capacity * 2;
+    stock_prices *prices = malloc(capacity * sizeof(stock_prices));
+
+    if (prices == NULL) {
+        return false;
+    }
+    memcpy(prices, builder->prices, builder->count * sizeof(stock_prices));
+    client->pending = prices + (client->pending - builder->prices);
+    client->end = prices + (client->end - builder->prices);
+    for (int i = 0; i < client->in_flight; i++) {
+        client->active[i]->prices = prices + (client->active[i]->prices - builder->prices);
+    }
+    for (int i = 0; i < client->retry_count; i++) {
+        client->retries[i] = prices + (client->retries[i] - builder->prices);
+    }
+    free(builder->prices);
+    builder->prices = prices;
+    builder->capacity = capacity;
+
+    return true;
+}
+
+// Reads securities, when streaming, until there are enough pending to fill
+// every free slot, with full batches
+static void read_ahead_securities(http_client *client) {
+    security_cursor *cursor = client->cursor;
+    long wanted = (long)(client->limit - client->in_flight) * options.batch;
+
+    while (!cursor->done && client->end - client->pending < wanted) {
+        if (cursor->builder.count == cursor->builder.capacity && !grow_streamed_securities(client)) {
+            log_error(ERROR_MESSAGE_FORMAT, "out of memory reading securities");
+            close_security_cursor(cursor, EXIT_FAILURE);
+            break;
+        }
+        read_next_security(cursor);
+        client->end = cursor->builder.prices + cursor->builder.count;
+    }
+}
+
+static bool has_pending_prices(const http_client *client) {
+    return client->pending < client->end || (client->cursor != NULL && !client->cursor->done);
+}
+
+// Memory held by the transfers in flight - libcurl's, and responses recorded
+// for the cache
+static size_t request_memory(const http_client *client) {
+    size_t bytes = (size_t)client->in_flight * HTTP_REQUEST_MEMORY;
+
+    for (int i = 0; i < client->in_flight; i++) {
+        const cached_response *response = client->active[i]->prices->response;
+        if (response) bytes += sizeof(cached_response) + response->capacity + response->cached.len;
+    }
+
+    return bytes;
+}
+
+// Another transfer fits in the window - within the concurrency limit, and
+// the memory budget, though one may always be in flight
+static bool can_submit_request(const http_client *client) {
+    return client->in_flight < client->limit &&
+           (client->memory_budget == 0 || client->in_flight == 0 ||
+            request_memory(client) + HTTP_REQUEST_MEMORY <= client->memory_budget);
+}
+
+static void submit_price_requests(http_client *client) {
+    double now = client->retry_count > 0 ? metrics_now() : 0;
+
+    if (client->cursor) read_ahead_securities(client);
+
+    for (int i = client->retry_count - 1; i >= 0 && can_submit_request(client); i--) {
+        stock_prices *prices = client->retries[i];
+        if (prices->retry_at <= now) {
+            client->retries[i] = client->retries[--client->retry_count];
+            submit_price_request_curl(client, prices);
+        }
+    }
+    while (client->pending < client->end && can_submit_request(client)) {
+        if (journal && resume_stock_prices(client->pending)) {
+            client->pending++;
+        } else {
+            submit_price_request_curl(client, take_pending_prices(client));
+        }
+    }
+}
+
+// Schedules another attempt of a throttled or failed download, after an
+// exponential backoff with jitter, or as long as Retry-After asks (up to
+// RETRY_MAX_DELAY_SECS) - unless attempts are exhausted, or rows have
+// already been handed to a writer
+static bool schedule_retry(http_client *client, stock_prices *prices, CURL *curl_easy,
+                           CURLcode result, long http_status) {
+    double delay = RETRY_BASE_DELAY_SECS * (1 << prices->attempts);
+
+    if ((result == CURLE_OK && http_status != 429 && http_status < 500) ||
+            prices->attempts >= options.retries || prices->emitted) {
+        return false;
+    }
+    if (delay > RETRY_MAX_DELAY_SECS) delay = RETRY_MAX_DELAY_SECS;
+    delay = delay / 2 + delay / 2 * random() / RAND_MAX;
+#if LIBCURL_VERSION_NUM >= 0x074200
+    curl_off_t retry_after = 0;
+    curl_easy_getinfo(curl_easy, CURLINFO_RETRY_AFTER, &retry_after);
+    if (retry_after > delay) delay = retry_after < RETRY_MAX_DELAY_SECS ? retry_after : RETRY_MAX_DELAY_SECS;
+#endif
+    if (result != CURLE_OK) {
+        log_info("Retrying %s in %.1fs (%s)...", prices->symbol, delay, curl_easy_strerror(result));
+    } else {
+        log_info("Retrying %s in %.1fs (HTTP %ld)...", prices->symbol, delay, http_status);
+    }
+
+    // Starts over, discarding anything parsed or recorded for the cache
+    prices->source->begin(prices);
+    if (prices->response) {
+        http_cache_entry_free(&prices->response->received);
+        memset(&prices->response->received, 0, sizeof(http_cache_entry));
+        prices->response->capacity = 0;
+        prices->response->incomplete = false;
+    }
+    prices->attempts++;
+    prices->retry_at = metrics_now() + delay;
+    if (client->retry_count == client->retry_capacity) {
+        client->retry_capacity = client->retry_capacity ? client->retry_capacity * 2 : MAX_HTTP_CONCURRENCY;
+        client->retries = realloc(client->retries, client->retry_capacity * sizeof(stock_prices*));
+    }
+    client->retries[client->retry_count++] = prices;
+
+    return true;
+}
+
+// Hedging threshold - the HEDGE_PERCENTILE of recent times to first byte
+static int compare_secs(const void *a, const void *b) {
+    double diff = *(const double*)a - *(const double*)b;
+
+    return (diff > 0) - (diff < 0);
+}
+
+static void record_response_latency(http_client *client, CURL *curl_easy) {
+    double sorted[HEDGE_SAMPLES];
+    int count;
+
+    curl_easy_getinfo(curl_easy, CURLINFO_STARTTRANSFER_TIME, &client->ttfb_samples[client->ttfb_count++ % HEDGE_SAMPLES]);
+    if (client->ttfb_count < HEDGE_MIN_SAMPLES) {
+        return;
+    }
+    count = client->ttfb_count < HEDGE_SAMPLES ? client->ttfb_count : HEDGE_SAMPLES;
+    memcpy(sorted, client->ttfb_samples, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), compare_secs);
+    client->hedge_after = sorted[(int)(count * HEDGE_PERCENTILE)];
+}
+
+// Duplicates requests still awaiting a response past the hedging threshold,
+// while there is capacity to spare - the first to respond is parsed, and the
+// other abandoned
+static void hedge_slow_requests(http_client *client) {
+    double now;
+
+    if (!options.hedge || client->hedge_after == 0) {
+        return;
+    }
+    now = metrics_now();
+    for (int i = 0; i < client->in_flight && can_submit_request(client); i++) {
+        price_request *request = client->active[i];
+        char *url = NULL;
+
+        if (request->hedged || request->prices->curl != NULL || now - request->started < client->hedge_after) {
+            continue;
+        }
+        request->hedged = true;
+        curl_easy_getinfo(request->curl, CURLINFO_EFFECTIVE_URL, &url);
+        log_debug("Hedging request for %s after %.3fs...", request->prices->symbol, now - request->started);
+        start_price_request(client, request->prices, url, true);
+    }
+}
+
+// Abandons any other transfer of the same security
+static void cancel_hedged_requests(http_client *client, price_request *done) {
+    for (int i = client->in_flight - 1; i >= 0; i--) {
+        if (client->active[i] != done && client->active[i]->prices == done->prices) {
+            release_price_request(client, client->active[i]);
+        }
+    }
+}
+
+static void record_request_metrics(CURL *curl_easy, stock_prices *prices) {
+    metrics_request request = { .symbol = prices->symbol, .parse_secs = prices->parse_secs };
+    curl_off_t bytes = 0;
+
+    curl_easy_getinfo(curl_easy, CURLINFO_RESPONSE_CODE, &request.http_status);
+    curl_easy_getinfo(curl_easy, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    request.bytes = (double)bytes;
+    curl_easy_getinfo(curl_easy, CURLINFO_NAMELOOKUP_TIME, &request.dns_secs);
+    curl_easy_getinfo(curl_easy, CURLINFO_CONNECT_TIME, &request.connect_secs);
+    curl_easy_getinfo(curl_easy, CURLINFO_APPCONNECT_TIME, &request.tls_secs);
+    curl_easy_getinfo(curl_easy, CURLINFO_STARTTRANSFER_TIME, &request.ttfb_secs);
+    curl_easy_getinfo(curl_easy, CURLINFO_TOTAL_TIME, &request.total_secs);
+    metrics_request_done(&request);
+}
+
+static void process_price_responses(http_client *client) {
+    CURLMsg *msg;
+    int msgs_left = -1;
+
+    while ((msg = curl_multi_info_read(client->multi, &msgs_left))) {
+        if (msg->msg == CURLMSG_DONE) {
+            CURL *curl_easy = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            price_request *request;
+            stock_prices *done_prices;
+            long http_status = 0;
+            double total_secs = 0;
+            curl_easy_getinfo(curl_easy, CURLINFO_PRIVATE, (char**)&request);
+            done_prices = request->prices;
+            // Lost to, or failed ahead of, a hedged duplicate
+            if (done_prices->curl != curl_easy && (done_prices->curl != NULL || done_prices->requests > 1)) {
+                release_price_request(client, request);
+                continue;
+            }
+            cancel_hedged_requests(client, request);
+            curl_easy_getinfo(curl_easy, CURLINFO_RESPONSE_CODE, &http_status);
+            curl_easy_getinfo(curl_easy, CURLINFO_TOTAL_TIME, &total_secs);
+            if (options.adaptive) adapt_http_concurrency(client, curl_easy, result);
+            if (schedule_retry(client, done_prices, curl_easy, result, http_status)) {
+                release_price_request(client, request);
+                continue;
+            }
+            if (result != CURLE_OK) {
+                log_warn("Failed to download prices for %s: %s", done_prices->symbol, curl_easy_strerror(result));
+                done_prices->load_state = LOAD_STATE_FAILED;
+            } else if (http_status != 200 && http_status != 304) {
+                log_warn("Failed to download prices for %s (HTTP %ld)", done_prices->symbol, http_status);
+            } else {
+                log_debug("Downloaded prices for %s in %.3fs (HTTP %ld)...",
+                          done_prices->symbol, total_secs, http_status);
+                if (options.hedge) record_response_latency(client, curl_easy);
+            }
+            if (metrics_enabled()) record_request_metrics(curl_easy, done_prices);
+            if (done_prices->response) finish_cached_response(client, done_prices, http_status);
+            finish_stock_prices(done_prices);
+            release_price_request(client, request);
+        } else {
+            log_error("HTTP error CURLMsg (%d)\n", msg->msg);
+        }
+    }
+}
+
+// Polling driver - performs, and waits for activity, in a loop
+static void run_poll_loop(http_client *client) {
+    int active_connections = 0;
+
+    do {
+        submit_price_requests(client);
+        curl_multi_perform(client->multi, &active_connections);
+        process_price_responses(client);
+        hedge_slow_requests(client);
+        if (active_connections) {
+            curl_multi_wait(client->multi, NULL, 0, POLL_TIMEOUT_MS, NULL);
+        } else if (client->retry_count > 0) {
+            struct timespec nap = { 0, POLL_TIMEOUT_MS * 1000000L };
+            nanosleep(&nap, NULL);
+        }
+    } while (client->in_flight > 0 || has_pending_prices(client) || client->retry_count > 0);
+}
+
+#ifdef HAVE_EPOLL
+static int handle_curl_socket_cb(CURL *curl_easy, curl_socket_t sock, int what, void *client_ptr, void *sock_ptr) {
+    http_client *client = (http_client*)client_ptr;
+    struct epoll_event event = { 0 };
+
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(client->epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+
+        return 0;
+    }
+    event.data.fd = sock;
+    if (what & CURL_POLL_IN) event.events |= EPOLLIN;
+    if (what & CURL_POLL_OUT) event.events |= EPOLLOUT;
+    if (sock_ptr == NULL) {
+        // Mark the socket as registered
+        epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, sock, &event);
+        curl_multi_assign(client->multi, sock, client);
+    } else {
+        epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, sock, &event);
+    }
+
+    return 0;
+}
+
+static int handle_curl_timer_cb(CURLM *curl_multi, long timeout_ms, void *client_ptr) {
+    http_client *client = (http_client*)client_ptr;
+
+    client->timeout_ms = timeout_ms;
+    clock_gettime(CLOCK_MONOTONIC, &client->timeout_set);
+
+    return 0;
+}
+
+// Remaining time until libcurl's timer expires, in ms (-1 if none)
+static int remaining_timeout_ms(http_client *client) {
+    struct timespec now;
+    long elapsed_ms;
+
+    if (client->timeout_ms < 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ms =
+        (now.tv_sec - client->timeout_set.tv_sec) * 1000 +
+        (now.tv_nsec - client->timeout_set.tv_nsec) / 1000000;
+
+    return elapsed_ms >= client->timeout_ms ? 0 : (int)(client->timeout_ms - elapsed_ms);
+}
+
+// Wakes at least every POLL_TIMEOUT_MS while retries are waiting, or requests may need hedging -
+// and at once when nothing is in flight, but securities are pending, as when
+// every request submitted was served from the cache or journal
+static int epoll_timeout_ms(http_client *client) {
+    int timeout_ms = remaining_timeout_ms(client);
+
+    if (client->in_flight == 0 && has_pending_prices(client)) {
+        return 0;
+    }
+    if ((client->retry_count > 0 || (options.hedge && client->hedge_after > 0)) &&
+            (timeout_ms < 0 || timeout_ms > POLL_TIMEOUT_MS)) {
+        return POLL_TIMEOUT_MS;
+    }
+
+    return timeout_ms;
+}
+
+// Event-driven driver - only services sockets that are ready, and
+// libcurl's timeouts when they expire
+static void run_epoll_loop(http_client *client) {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int running;
+
+    client->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    client->timeout_ms = -1;
+    curl_multi_setopt(client->multi, CURLMOPT_SOCKETFUNCTION, handle_curl_socket_cb);
+    curl_multi_setopt(client->multi, CURLMOPT_SOCKETDATA, client);
+    curl_multi_setopt(client->multi, CURLMOPT_TIMERFUNCTION, handle_curl_timer_cb);
+    curl_multi_setopt(client->multi, CURLMOPT_TIMERDATA, client);
+
+    submit_price_requests(client);
+    while (client->in_flight > 0 || has_pending_prices(client) || client->retry_count > 0) {
+        int num_events = epoll_wait(client->epoll_fd, events, EPOLL_MAX_EVENTS, epoll_timeout_ms(client));
+
+        for (int i = 0; i < num_events; i++) {
+            int flags = 0;
+            if (events[i].events & EPOLLIN) flags |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(client->multi, events[i].data.fd, flags, &running);
+        }
+        if (remaining_timeout_ms(client) == 0) {
+            client->timeout_ms = -1;
+            curl_multi_socket_action(client->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+        process_price_responses(client);
+        submit_price_requests(client);
+        hedge_slow_requests(client);
+    }
+
+    curl_multi_setopt(client->multi, CURLMOPT_SOCKETFUNCTION, NULL);
+    curl_multi_setopt(client->multi, CURLMOPT_TIMERFUNCTION, NULL);
+    close(client->epoll_fd);
+}
+#endif
+
+// Runs task for every index in [0, count), on up to jobs threads, including this one
+typedef struct parallel_tasks {
+    pthread_mutex_t mutex;
+    int next;
+    int count;
+    void (*task)(void *ctx, int index);
+    void *ctx;
+} parallel_tasks;
+
+static void *run_parallel_tasks(void *tasks_ptr) {
+    parallel_tasks *tasks = (parallel_tasks*)tasks_ptr;
+    int index;
+
+    while (true) {
+        pthread_mutex_lock(&tasks->mutex);
+        index = tasks->next++;
+        pthread_mutex_unlock(&tasks->mutex);
+        if (index >= tasks->count) break;
+        tasks->task(tasks->ctx, index);
+    }
+
+    return NULL;
+}
+
+static void run_in_parallel(int jobs, int count, void (*task)(void *ctx, int index), void *ctx) {
+    parallel_tasks tasks = { .count = count, .task = task, .ctx = ctx };
+    pthread_t threads[MAX_WRITER_JOBS];
+    int started = 0;
+
+    pthread_mutex_init(&tasks.mutex, NULL);
+    if (jobs > count) jobs = count;
+    while (started < jobs - 1 && pthread_create(&threads[started], NULL, run_parallel_tasks, &tasks) == 0) {
+        started++;
+    }
+    run_parallel_tasks(&tasks);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&tasks.mutex);
+}
+
+// Securities downloaded by each worker - contiguous shards, of near equal size
+typedef struct download_shards {
+    http_client *clients;
+    stock_prices *prices;
+    int count;
+} download_shards;
+
+static void run_download_loop(http_client *client) {
+#ifdef HAVE_EPOLL
+    if (options.epoll) {
+        run_epoll_loop(client);
+        return;
+    }
+#endif
+    run_poll_loop(client);
+}
+
+static void download_shard(void *shards_ptr, int index) {
+    download_shards *shards = (download_shards*)shards_ptr;
+    http_client *client = &shards->clients[index];
+
+    client->pending = shards->prices + (long)shards->count * index / options.workers;
+    client->end = shards->prices + (long)shards->count * (index + 1) / options.workers;
+    run_download_loop(client);
+}
+
+// Streams downloaded rows to the writer of each security as they complete,
+// when it has one, and revalidates against the client's cache, when it has one
+static int enrich_stock_prices(http_client *clients, stock_prices *prices, int count) {
+    // Async HTTP calls, largely based on:
+    // https://curl.haxx.se/libcurl/c/10-at-a-time.html
+    // and, for the epoll driver:
+    // https://curl.se/libcurl/c/ephiperfifo.html
+    download_shards shards = { .clients = clients, .prices = prices, .count = count };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifndef HAVE_EPOLL
+    if (options.epoll) log_warn("epoll is not available on this platform, polling instead...");
+#endif
+    if (options.workers > 1) {
+        log_debug("Downloading prices on %d workers...", options.workers);
+    }
+    run_in_parallel(options.workers, options.workers, download_shard, &shards);
+
+    metrics_phase(METRICS_PHASE_DOWNLOAD, elapsed_secs(&start));
+    log_debug("Downloaded prices in %.3fs...", elapsed_secs(&start));
+
+    return EXIT_SUCCESS;
+}
+
+// Downloads prices while the securities of a book are still being read, so
+// that the first request goes out with the first row, rather than after the
+// last - the book's securities are set once all have been read
+static int stream_stock_prices(http_client *client, price_book *book) {
+    security_cursor *cursor = &book->cursor;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifndef HAVE_EPOLL
+    if (options.epoll) log_warn("epoll is not available on this platform, polling instead...");
+#endif
+    log_debug("Streaming securities...");
+    client->cursor = cursor;
+    client->pending = client->end = cursor->builder.prices;
+    run_download_loop(client);
+    client->cursor = NULL;
+    // Securities left unread would otherwise be committed as if synchronized
+    if (!cursor->done) {
+        log_error(ERROR_MESSAGE_FORMAT, "download loop ended before every security was read");
+        close_security_cursor(cursor, EXIT_FAILURE);
+    }
+
+    book->prices = cursor->builder.prices;
+    book->count = cursor->builder.count;
+    cursor->builder.prices = NULL;
+    if (cursor->status != EXIT_SUCCESS) book->exit = EXIT_FAILURE;
+    metrics_phase(METRICS_PHASE_DOWNLOAD, elapsed_secs(&start));
+    log_debug("Downloaded prices in %.3fs...", elapsed_secs(&start));
+
+    return book->exit;
+}
+
+static int persist_stock_prices(price_writer *writer, stock_prices *prices, int read_count) {
+    int count = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (stock_prices *end = prices + read_count; prices < end; prices++) {
+        if (prices->load_state == LOAD_STATE_SUCCESS) {
+            if (write_stock_price(writer, prices) == EXIT_SUCCESS) {
+                count++;
+            }
+        } else if (prices->load_state == LOAD_STATE_PERSISTED) {
+            count++;
+        }
+    }
+    metrics_phase(METRICS_PHASE_PERSIST, elapsed_secs(&start));
+    log_info("Staged prices for %d securities...", count);
+
+    return EXIT_SUCCESS;
+}
+
+// Data directories given on the command line, followed by those in the manifest
+static int read_books(int dir_count, char **dirs, price_book **books, int *count) {
+    int capacity = dir_count > 0 ? dir_count : 1;
+    char line[PATH_MAX];
+    FILE *manifest = NULL;
+
+    *books = calloc(capacity, sizeof(price_book));
+    *count = 0;
+    for (int i = 0; i < dir_count; i++) {
+        (*books)[(*count)++].data_dir = strdup(dirs[i]);
+    }
+    if (options.manifest_path == NULL) {
+        return EXIT_SUCCESS;
+    }
+    if ((manifest = fopen(options.manifest_path, "r")) == NULL) {
+        fprintf(stderr, "Unable to read manifest %s.\n", options.manifest_path);
+        free(*books);
+
+        return EXIT_FAILURE;
+    }
+    while (fgets(line, sizeof(line), manifest) != NULL) {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (len == 0 || line[0] == MANIFEST_COMMENT) continue;
+        if (*count == capacity) {
+            capacity *= 2;
+            *books = realloc(*books, capacity * sizeof(price_book));
+        }
+        memset(&(*books)[*count], 0, sizeof(price_book));
+        (*books)[(*count)++].data_dir = strdup(line);
+    }
+    fclose(manifest);
+    if (*count == 0) {
+        fprintf(stderr, "No data directories in manifest %s.\n", options.manifest_path);
+        free(*books);
+
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Whether the planner matches staged rows by searching an index on zprice -
+// automatic indexes are built by each merge, scanning zprice all the same
+static bool upserts_search_index(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    bool indexed = false;
+
+    if (sqlite3_prepare_v2(db, EXPLAIN_MATCH_STAGED_PRICE_SQL, -1, &stmt, NULL) != SQLITE_OK) {
+        log_warn("Unable to explain query plan: %s", sqlite3_errmsg(db));
+
+        return false;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *detail = (const char*)sqlite3_column_text(stmt, EXPLAIN_DETAIL_COLUMN);
+
+        log_trace("Query plan: %s", detail);
+        if (detail != NULL && strncmp(detail, "SEARCH ", 7) == 0 &&
+                strstr(detail, "zprice") != NULL && strstr(detail, "AUTOMATIC") == NULL) {
+            indexed = true;
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    return indexed;
+}
+
+// Finds the index ibdq creates, which a run that crashed or was killed may
+// have left behind
+static bool has_upsert_index(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    bool found;
+
+    if (sqlite3_prepare_v2(db, FIND_UPSERT_INDEX_SQL, -1, &stmt, NULL) != SQLITE_OK) {
+        log_warn("Unable to look up index on zprice: %s", sqlite3_errmsg(db));
+
+        return false;
+    }
+    found = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+
+    return found;
+}
+
+// Checks the query plan of the upsert path, creating an index, when asked to,
+// should it scan zprice - the index is ibdq's, and dropped when the book is
+// closed, even when left by an earlier run
+static void index_price_upserts(price_book *book) {
+    struct timespec start;
+
+    if (has_upsert_index(book->db)) {
+        book->created_index = true;
+        log_info("Found index on zprice left by an earlier run, dropping it once done...");
+    }
+    if (upserts_search_index(book->db)) {
+        log_debug("Upserts search an index on zprice...");
+        return;
+    }
+    if (!options.index) {
+        log_warn("Upserts scan zprice, as it has no index on (zsecurityid, zdate) - see --index...");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (exec_sql(book->db, CREATE_UPSERT_INDEX_SQL) == EXIT_SUCCESS) {
+        book->created_index = true;
+        log_info("Created index on zprice in %.3fs...", elapsed_secs(&start));
+    }
+}
+
+// Opens the data file, and prepares the writer's statements, once for the life of the process
+static int open_book(price_book *book) {
+    if (sqlite3_open(book->sqlite_file, &book->db) != SQLITE_OK) {
+        log_error(ERROR_MESSAGE_FORMAT, sqlite3_errmsg(book->db));
+        sqlite3_close(book->db);
+        book->db = NULL;
+
+        return EXIT_FAILURE;
+    }
+    if (open_price_writer(book->db, &book->writer) != EXIT_SUCCESS) {
+        sqlite3_close(book->db);
+        book->db = NULL;
+
+        return EXIT_FAILURE;
+    }
+    book->writer_open = true;
+    index_price_upserts(book);
+    if (options.stream) {
+        exec_sql(book->db, MMAP_SQL);
+        if (sqlite3_prepare_v2(book->db, options.incremental ? SELECT_SECURITY_LATEST_PRICE_SQL : SELECT_SECURITY_SQL,
+                               -1, &book->cursor.stmt, NULL) != SQLITE_OK) {
+            log_error(ERROR_MESSAGE_FORMAT, sqlite3_errmsg(book->db));
+            close_price_writer(&book->writer);
+            book->writer_open = false;
+            sqlite3_close(book->db);
+            book->db = NULL;
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Reads the securities of a book, opening it if it is not yet open, and
+// begins its transaction for this refresh - when streaming, securities are
+// read as their prices download instead
+static int begin_book(price_book *book, bool stream) {
+    book->exit = EXIT_FAILURE;
+    if (book->sqlite_file == NULL) {
+        book->sqlite_file = malloc(strlen(book->data_dir) + sizeof(ACCOUNTS_DATA_FILE));
+        strcpy(book->sqlite_file, book->data_dir);
+        strcat(book->sqlite_file, ACCOUNTS_DATA_FILE);
+    }
+    log_info("Processing SQLite file %s...", book->sqlite_file);
+    if (!book->writer_open && open_book(book) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    free(book->prices);
+    book->prices = NULL;
+    book->count = 0;
+    book->shared = 0;
+    symbol_table_free(&book->symbols);
+    if (stream) {
+        // Streamed rows are written as they download, as when reading them all first
+        bool writing = options.backfill || options.incremental || options.pipeline;
+        if (open_security_cursor(&book->cursor, &book->symbols, writing ? &book->writer : NULL) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    } else if (read_securities(book->db, &book->symbols, &book->count, &book->prices, &book->shared) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (begin_price_writer(&book->writer) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    book->writing = true;
+    book->exit = EXIT_SUCCESS;
+
+    return EXIT_SUCCESS;
+}
+
+// Merges and commits a book, or rolls it back should it have failed
+static void end_book(void *books_ptr, int index) {
+    price_book *book = &((price_book*)books_ptr)[index];
+
+    if (book->writing && end_price_writer(&book->writer, book->exit == EXIT_SUCCESS) != EXIT_SUCCESS) {
+        book->exit = EXIT_FAILURE;
+    }
+    book->writing = false;
+}
+
+static void close_book(price_book *book) {
+    if (book->writer_open) close_price_writer(&book->writer);
+    sqlite3_finalize(book->cursor.stmt);
+    free(book->cursor.builder.prices);
+    if (book->created_index && exec_sql(book->db, DROP_UPSERT_INDEX_SQL) == EXIT_SUCCESS) {
+        log_debug("Dropped index on zprice...");
+    }
+    sqlite3_close(book->db);
+    free(book->prices);
+    symbol_table_free(&book->symbols);
+    free(book->sqlite_file);
+    free((char*)book->data_dir);
+}
+
+static int compare_symbols(const void *a, const void *b) {
+    return strcmp((*(stock_prices* const*)a)->symbol, (*(stock_prices* const*)b)->symbol);
+}
+
+// Merges the securities of all books by symbol, so that each symbol is
+// downloaded once, and its rows handed to every book holding it
+static stock_prices *merge_book_securities(price_book *books, int book_count,
+                                           stock_prices ***holders_ptr, int *count) {
+    stock_prices **holders;
+    stock_prices *downloads;
+    int total = 0;
+
+    for (int i = 0; i < book_count; i++) {
+        if (books[i].exit == EXIT_SUCCESS) total += books[i].count;
+    }
+    holders = malloc((total ? total : 1) * sizeof(stock_prices*));
+    total = 0;
+    for (int i = 0; i < book_count; i++) {
+        for (int j = 0; books[i].exit == EXIT_SUCCESS && j < books[i].count; j++) {
+            books[i].prices[j].writer = &books[i].writer;
+            holders[total++] = &books[i].prices[j];
+        }
+    }
+    qsort(holders, total, sizeof(stock_prices*), compare_symbols);
+
+    downloads = malloc((total ? total : 1) * sizeof(stock_prices));
+    *count = 0;
+    for (int i = 0, j; i < total; i = j) {
+        stock_prices *download = &downloads[(*count)++];
+
+        *download = *holders[i];
+        download->writer = NULL;
+        download->targets = &holders[i];
+        for (j = i + 1; j < total && strcmp(holders[j]->symbol, download->symbol) == 0; j++) {
+            // The widest range any book needs
+            long period_start = holders[j]->period_start;
+            if (period_start != PERIOD_LATEST &&
+                    (download->period_start == PERIOD_LATEST || period_start < download->period_start)) {
+                download->period_start = period_start;
+            }
+        }
+        download->target_count = j - i;
+    }
+    *holders_ptr = holders;
+
+    return downloads;
+}
+
+// One refresh - reads the securities of every book, downloads their prices
+// once per symbol, and merges them into each book
+static int sync_books(price_book *books, int book_count, http_client *clients) {
+    stock_prices *downloads = NULL;
+    stock_prices **holders = NULL;
+    int download_count = 0;
+    price_pipeline *pipelines = NULL;
+    int pipeline_count = 0;
+    int exit = EXIT_SUCCESS;
+    // Securities of several books are merged by symbol, and shared out
+    // between workers, once all have been read
+    bool stream = options.stream && book_count == 1 && options.workers == 1;
+    bool downloading;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    metrics_reset();
+    if (journal) {
+        // Latest prices journaled before the close, or on an earlier day, are stale
+        bool closed;
+        long generation = calendar_latest_trading_day(time(NULL), &closed) * 2 + closed;
+
+        if (checkpoint_begin(journal, generation) != 0) {
+            log_warn("Unable to begin checkpoint journal, downloading all prices...");
+            checkpoint_end(journal, false);
+            journal = NULL;
+        }
+    }
+    for (int i = 0; i < book_count; i++) {
+        if (begin_book(&books[i], stream) != EXIT_SUCCESS) exit = EXIT_FAILURE;
+    }
+    if (book_count > 1) {
+        downloads = merge_book_securities(books, book_count, &holders, &download_count);
+        log_info("Found %d distinct symbols in %d books...", download_count, book_count);
+    } else if (!stream && books[0].exit == EXIT_SUCCESS && books[0].shared > 0) {
+        // Securities sharing a symbol are downloaded once, as across books
+        downloads = merge_book_securities(books, book_count, &holders, &download_count);
+        log_info("Found %d distinct symbols...", download_count);
+    } else if (!stream && books[0].exit == EXIT_SUCCESS) {
+        // Streamed securities are given their writer as they are read
+        downloads = books[0].prices;
+        download_count = books[0].count;
+        if (options.backfill || options.incremental || options.pipeline) {
+            for (int i = 0; i < download_count; i++) downloads[i].writer = &books[0].writer;
+        }
+    }
+    downloading = stream ? books[0].exit == EXIT_SUCCESS : download_count > 0;
+    // Writer threads, each serving a share of the books - also needed by
+    // download workers, so that only writer threads use each book
+    if (downloading && (options.pipeline || book_count > 1 || options.workers > 1)) {
+        int jobs = options.jobs < book_count ? options.jobs : book_count;
+
+        pipelines = calloc(jobs, sizeof(price_pipeline));
+        while (pipeline_count < jobs && start_price_pipeline(&pipelines[pipeline_count]) == EXIT_SUCCESS) {
+            pipeline_count++;
+        }
+        for (int i = 0; i < book_count && pipeline_count > 0; i++) {
+            books[i].writer.pipeline = &pipelines[i % pipeline_count];
+        }
+    }
+
+    if (downloading) {
+        if (options.backfill) log_info("Backfilling full price history...");
+        if (stream) {
+            stream_stock_prices(&clients[0], &books[0]);
+        } else {
+            enrich_stock_prices(clients, downloads, download_count);
+        }
+    }
+    for (int i = 0; i < book_count; i++) {
+        if (books[i].exit == EXIT_SUCCESS) {
+            persist_stock_prices(&books[i].writer, books[i].prices, books[i].count);
+        }
+    }
+    for (int i = 0; i < pipeline_count; i++) {
+        stop_price_pipeline(&pipelines[i]);
+    }
+    run_in_parallel(options.jobs, book_count, end_book, books);
+    for (int i = 0; i < book_count; i++) {
+        books[i].writer.pipeline = NULL;
+        if (books[i].exit != EXIT_SUCCESS) exit = EXIT_FAILURE;
+    }
+    if (journal) {
+        if (journal->replayed > 0) {
+            log_info("Resumed %d securities from the checkpoint journal...", journal->replayed);
+        }
+        // Kept for the next run unless every book has committed its prices
+        if (checkpoint_end(journal, exit == EXIT_SUCCESS) != 0) {
+            log_warn("Failed to commit checkpoint journal...");
+        }
+    }
+
+    free(pipelines);
+    // Merged downloads are copies, rather than the securities of a book
+    if (holders) free(downloads);
+    free(holders);
+
+    metrics_phase(METRICS_PHASE_TOTAL, elapsed_secs(&start));
+    if (options.metrics_path && metrics_write(options.metrics_path) != 0) {
+        log_error("Failed to write metrics to %s", options.metrics_path);
+    }
+    if (exit == EXIT_SUCCESS) {
+        log_info("Security prices synchronized in %.3fs.", elapsed_secs(&start));
+    }
+
+    return exit;
+}
+
+// Daemon mode signals - SIGHUP refreshes now, SIGINT and SIGTERM stop after the current refresh
+static volatile sig_atomic_t refresh_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_daemon_signal(int sig) {
+    if (sig == SIGHUP) {
+        refresh_requested = 1;
+    } else {
+        stop_requested = 1;
+    }
+}
+
+static void install_daemon_signal_handlers(void) {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_daemon_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+// Sleeps until the next refresh is due or requested, returning false when asked to stop
+static bool await_refresh(void) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!stop_requested && !refresh_requested) log_debug("Next refresh in %lds...", options.interval);
+    while (!stop_requested && !refresh_requested && elapsed_secs(&start) < options.interval) {
+        // Naps are interrupted by signals, and short, should one arrive just before napping
+        double remaining = options.interval - elapsed_secs(&start);
+        struct timespec nap = { DAEMON_NAP_SECS, 0 };
+        if (remaining < DAEMON_NAP_SECS) nap = (struct timespec){ 0, (long)(remaining * 1.0e9) };
+        nanosleep(&nap, NULL);
+    }
+    if (stop_requested) {
+        log_info("Stopping...");
+
+        return false;
+    }
+    if (refresh_requested) log_info("Refreshing on SIGHUP...");
+    refresh_requested = 0;
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        { "backfill", no_argument, NULL, 'b' },
+        { "incremental", no_argument, NULL, 'i' },
+        { "pipeline", no_argument, NULL, 'p' },
+        { "concurrency", required_argument, NULL, 'c' },
+        { "adaptive", no_argument, NULL, 'a' },
+        { "epoll", no_argument, NULL, 'e' },
+        { "price-url", required_argument, NULL, 'u' },
+        { "cache-ttl", required_argument, NULL, 't' },
+        { "metrics", required_argument, NULL, 'm' },
+        { "manifest", required_argument, NULL, 'f' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "daemon", no_argument, NULL, 'd' },
+        { "interval", required_argument, NULL, 'r' },
+        { "index", no_argument, NULL, 'x' },
+        { "timeout", required_argument, NULL, 'T' },
+        { "retries", required_argument, NULL, 'n' },
+        { "hedge", no_argument, NULL, 'H' },
+        { "workers", required_argument, NULL, 'w' },
+        { "batch", required_argument, NULL, 'B' },
+        { "batch-url", required_argument, NULL, 'U' },
+        { "stream", no_argument, NULL, 's' },
+        { "memory", required_argument, NULL, 'M' },
+        { "resume", no_argument, NULL, 'R' },
+        { NULL, 0, NULL, 0 }
+    };
+    int exit = EXIT_FAILURE;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "bipc:aeu:t:m:f:j:dr:xT:n:Hw:B:U:sM:R", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                options.backfill = true;
+                break;
+            case 'i':
+                options.incremental = true;
+                break;
+            case 'p':
+                options.pipeline = true;
+                break;
+            case 'c':
+                options.concurrency = atoi(optarg);
+                if (options.concurrency < 1 || options.concurrency > MAX_HTTP_CONCURRENCY) {
+                    fprintf(stderr, "Concurrency must be between 1 and %d.\n", MAX_HTTP_CONCURRENCY);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'a':
+                options.adaptive = true;
+                break;
+            case 'e':
+                options.epoll = true;
+                break;
+            case 'u':
+                if (strstr(optarg, PRICE_URL_SYMBOL_PLACEHOLDER) == NULL ||
+                        strlen(optarg) > MAX_PRICE_URL_LEN / 2) {
+                    fprintf(stderr, "Price URL must contain %s, and be at most %d characters.\n",
+                            PRICE_URL_SYMBOL_PLACEHOLDER, MAX_PRICE_URL_LEN / 2);
+                    return EXIT_FAILURE;
+                }
+                options.price_url = optarg;
+                break;
+            case 't':
+                options.cache_ttl = atol(optarg);
+                options.cache = true;
+                if (options.cache_ttl < 0) {
+                    fprintf(stderr, "Cache TTL must not be negative.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                options.metrics_path = optarg;
+                metrics_set_enabled(true);
+                break;
+            case 'f':
+                options.manifest_path = optarg;
+                break;
+            case 'j':
+                options.jobs = atoi(optarg);
+                if (options.jobs < 1 || options.jobs > MAX_WRITER_JOBS) {
+                    fprintf(stderr, "Jobs must be between 1 and %d.\n", MAX_WRITER_JOBS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                options.daemon = true;
+                break;
+            case 'r':
+                options.interval = atol(optarg);
+                if (options.interval < 1) {
+                    fprintf(stderr, "Interval must be at least 1 second.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'x':
+                options.index = true;
+                break;
+            case 'T':
+                options.timeout = atol(optarg);
+                if (options.timeout < 0) {
+                    fprintf(stderr, "Timeout must not be negative.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                options.retries = atoi(optarg);
+                if (options.retries < 0 || options.retries > MAX_HTTP_RETRIES) {
+                    fprintf(stderr, "Retries must be between 0 and %d.\n", MAX_HTTP_RETRIES);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'H':
+                options.hedge = true;
+                break;
+            case 'w':
+                options.workers = atoi(optarg);
+                if (options.workers < 1 || options.workers > MAX_DOWNLOAD_WORKERS) {
+                    fprintf(stderr, "Workers must be between 1 and %d.\n", MAX_DOWNLOAD_WORKERS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'B':
+                options.batch = atoi(optarg);
+                if (options.batch < 1 || options.batch > MAX_BATCH_SIZE) {
+                    fprintf(stderr, "Batch size must be between 1 and %d.\n", MAX_BATCH_SIZE);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'U':
+                if (strstr(optarg, PRICE_URL_SYMBOL_PLACEHOLDER) == NULL ||
+                        strlen(optarg) > MAX_PRICE_URL_LEN / 2) {
+                    fprintf(stderr, "Batch URL must contain %s, and be at most %d characters.\n",
+                            PRICE_URL_SYMBOL_PLACEHOLDER, MAX_PRICE_URL_LEN / 2);
+                    return EXIT_FAILURE;
+                }
+                options.batch_url = optarg;
+                break;
+            case 's':
+                options.stream = true;
+                break;
+            case 'M':
+                if (atol(optarg) < 0) {
+                    fprintf(stderr, "Memory budget must not be negative.\n");
+                    return EXIT_FAILURE;
+                }
+                options.memory_budget = (size_t)atol(optarg) * BYTES_PER_MB;
+                break;
+            case 'R':
+                options.resume = true;
+                break;
+            default:
+                fprintf(stderr, USAGE_FORMAT, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind >= 1 || options.manifest_path) {
+        price_book *books = NULL;
+        int book_count = 0;
+        char *cache_file = NULL;
+        http_cache cache;
+        char *checkpoint_file = NULL;
+        checkpoint checkpoint_journal;
+        http_share share;
+        http_client *clients;
+
+        log_set_level(LOG_DEBUG);
+        log_set_quiet(true); // Don't log to stderr
+        log_set_fp(stdout);
+        if (read_books(argc - optind, argv + optind, &books, &book_count) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (options.cache) {
+            cache_file = malloc(strlen(books[0].data_dir) + sizeof(HTTP_CACHE_FILE));
+            strcpy(cache_file, books[0].data_dir);
+            strcat(cache_file, HTTP_CACHE_FILE);
+            if (http_cache_open(&cache, cache_file, options.cache_ttl) == 0) {
+                log_debug("Using HTTP cache %s...", cache_file);
+            } else {
+                log_warn("Unable to open HTTP cache %s, downloading all prices...", cache_file);
+                options.cache = false;
+            }
+        }
+        if (options.resume) {
+            checkpoint_file = malloc(strlen(books[0].data_dir) + sizeof(CHECKPOINT_FILE));
+            strcpy(checkpoint_file, books[0].data_dir);
+            strcat(checkpoint_file, CHECKPOINT_FILE);
+            if (checkpoint_open(&checkpoint_journal, checkpoint_file) == 0) {
+                log_debug("Using checkpoint journal %s...", checkpoint_file);
+            } else {
+                log_warn("Unable to open checkpoint journal %s, downloading all prices...", checkpoint_file);
+                options.resume = false;
+            }
+        }
+        // Kept for the life of the process, so that a daemon reuses its
+        // connections and TLS sessions from one refresh to the next
+        log_trace("Using %s", curl_version());
+        curl_global_init(CURL_GLOBAL_ALL);
+        // Every worker needs at least one request in flight
+        if (options.workers > options.concurrency) options.workers = options.concurrency;
+        init_http_share(&share);
+        clients = calloc(options.workers, sizeof(http_client));
+        for (int i = 0; i < options.workers; i++) {
+            init_http_client(&clients[i], options.cache ? &cache : NULL, &share, i);
+        }
+        // Retry jitter
+        srandom((unsigned)time(NULL) ^ (unsigned)getpid());
+        if (options.daemon) {
+            install_daemon_signal_handlers();
+            log_info("Running as a daemon, refreshing every %lds...", options.interval);
+        }
+
+        do {
+            journal = options.resume ? &checkpoint_journal : NULL;
+            exit = sync_books(books, book_count, clients);
+        } while (options.daemon && await_refresh());
+
+        for (int i = 0; i < options.workers; i++) {
+            cleanup_http_client(&clients[i]);
+        }
+        free(clients);
+        cleanup_http_share(&share);
+        curl_global_cleanup();
+        for (int i = 0; i < book_count; i++) {
+            close_book(&books[i]);
+        }
+        if (options.cache) http_cache_close(&cache);
+        free(cache_file);
+        if (options.resume) checkpoint_close(&checkpoint_journal);
+        free(checkpoint_file);
+        free(books);
+
         return exit;
     } else {
-        fprintf(stderr, "Please specify path to ibank data file.\n");
+        fprintf(stderr, "Please specify path to ibank data file, or a manifest.\n");
+        fprintf(stderr, USAGE_FORMAT, argv[0]);
         return EXIT_FAILURE;
     }
 }
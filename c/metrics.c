@@ -0,0 +1,293 @@
+/**
+ * Timing instrumentation for ibdq - see metrics.h.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define PROMETHEUS_SUFFIX ".prom"
+#define TMP_SUFFIX ".tmp"
+/* Control characters below this are written as \u00XX escapes in JSON strings */
+#define JSON_MIN_UNESCAPED_CHAR 0x20
+
+typedef struct metrics_request_entry {
+    char symbol[METRICS_MAX_SYMBOL_LEN + 1];
+    long http_status;
+    double bytes;
+    double dns_secs;
+    double connect_secs;
+    double tls_secs;
+    double ttfb_secs;
+    double total_secs;
+    double parse_secs;
+} metrics_request_entry;
+
+static struct {
+    bool enabled;
+    /* Guards phase and statement timings, recorded from writer threads */
+    pthread_mutex_t mutex;
+    double phase_secs[METRICS_PHASE_COUNT];
+    double sql_secs[METRICS_SQL_COUNT];
+    long sql_count[METRICS_SQL_COUNT];
+    metrics_request_entry *requests;
+    int request_count;
+    int request_capacity;
+} M = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+
+static const char *phase_names[] = {
+    "read", "download", "persist", "commit", "total"
+};
+
+static const char *sql_names[] = {
+    "select_security", "stage", "match", "update", "insert", "update_pk", "clear", "commit"
+};
+
+
+void metrics_set_enabled(bool enable) {
+    M.enabled = enable;
+}
+
+
+bool metrics_enabled(void) {
+    return M.enabled;
+}
+
+
+double metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1.0e9;
+}
+
+
+void metrics_reset(void) {
+    pthread_mutex_lock(&M.mutex);
+    memset(M.phase_secs, 0, sizeof(M.phase_secs));
+    memset(M.sql_secs, 0, sizeof(M.sql_secs));
+    memset(M.sql_count, 0, sizeof(M.sql_count));
+    M.request_count = 0;
+    pthread_mutex_unlock(&M.mutex);
+}
+
+
+void metrics_phase(int phase, double secs) {
+    pthread_mutex_lock(&M.mutex);
+    M.phase_secs[phase] += secs;
+    pthread_mutex_unlock(&M.mutex);
+}
+
+
+void metrics_sql(int stmt, double secs) {
+    pthread_mutex_lock(&M.mutex);
+    M.sql_secs[stmt] += secs;
+    M.sql_count[stmt]++;
+    pthread_mutex_unlock(&M.mutex);
+}
+
+
+void metrics_request_done(const metrics_request *request) {
+    if (!M.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&M.mutex);
+    if (M.request_count == M.request_capacity) {
+        int capacity = M.request_capacity ? M.request_capacity * 2 : 256;
+        metrics_request_entry *requests = realloc(M.requests, capacity * sizeof(metrics_request_entry));
+        if (requests == NULL) {
+            pthread_mutex_unlock(&M.mutex);
+            return;
+        }
+        M.requests = requests;
+        M.request_capacity = capacity;
+    }
+
+    metrics_request_entry *entry = &M.requests[M.request_count++];
+    snprintf(entry->symbol, sizeof(entry->symbol), "%s", request->symbol);
+    entry->http_status = request->http_status;
+    entry->bytes = request->bytes;
+    entry->dns_secs = request->dns_secs;
+    entry->connect_secs = request->connect_secs;
+    entry->tls_secs = request->tls_secs;
+    entry->ttfb_secs = request->ttfb_secs;
+    entry->total_secs = request->total_secs;
+    entry->parse_secs = request->parse_secs;
+    pthread_mutex_unlock(&M.mutex);
+}
+
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* Nearest-rank request latency quantiles, from the total time of each request */
+static void request_quantiles(double *p50, double *p99, double *max) {
+    double *totals;
+
+    *p50 = *p99 = *max = 0;
+    if (M.request_count == 0 || (totals = malloc(M.request_count * sizeof(double))) == NULL) {
+        return;
+    }
+    for (int i = 0; i < M.request_count; i++) {
+        totals[i] = M.requests[i].total_secs;
+    }
+    qsort(totals, M.request_count, sizeof(double), compare_doubles);
+    *p50 = totals[(int)ceil(M.request_count * 0.50) - 1];
+    *p99 = totals[(int)ceil(M.request_count * 0.99) - 1];
+    *max = totals[M.request_count - 1];
+    free(totals);
+}
+
+
+/* Time from the previous stage's end to this one's, given libcurl's cumulative times */
+static double stage_secs(double end_secs, double *prev_end_secs) {
+    double secs = end_secs > *prev_end_secs ? end_secs - *prev_end_secs : 0;
+
+    if (end_secs > *prev_end_secs) *prev_end_secs = end_secs;
+
+    return secs;
+}
+
+
+static void request_stages(const metrics_request_entry *r, double *dns, double *connect,
+                           double *tls, double *ttfb, double *transfer) {
+    double prev_end_secs = 0;
+
+    *dns = stage_secs(r->dns_secs, &prev_end_secs);
+    *connect = stage_secs(r->connect_secs, &prev_end_secs);
+    *tls = stage_secs(r->tls_secs, &prev_end_secs);
+    *ttfb = stage_secs(r->ttfb_secs, &prev_end_secs);
+    *transfer = stage_secs(r->total_secs, &prev_end_secs);
+}
+
+
+static void write_json(FILE *fp) {
+    double p50, p99, max;
+
+    request_quantiles(&p50, &p99, &max);
+    fprintf(fp, "{\n  \"phases\": {");
+    for (int i = 0; i < METRICS_PHASE_COUNT; i++) {
+        fprintf(fp, "%s\n    \"%s\": %.6f", i ? "," : "", phase_names[i], M.phase_secs[i]);
+    }
+    fprintf(fp, "\n  },\n  \"sqlite\": {");
+    for (int i = 0; i < METRICS_SQL_COUNT; i++) {
+        fprintf(fp, "%s\n    \"%s\": { \"count\": %ld, \"seconds\": %.6f }",
+                i ? "," : "", sql_names[i], M.sql_count[i], M.sql_secs[i]);
+    }
+    fprintf(fp, "\n  },\n  \"requests\": {\n");
+    fprintf(fp, "    \"count\": %d,\n", M.request_count);
+    fprintf(fp, "    \"p50\": %.6f,\n    \"p99\": %.6f,\n    \"max\": %.6f,\n", p50, p99, max);
+    fprintf(fp, "    \"symbols\": [");
+    for (int i = 0; i < M.request_count; i++) {
+        const metrics_request_entry *r = &M.requests[i];
+        double dns, connect, tls, ttfb, transfer;
+
+        request_stages(r, &dns, &connect, &tls, &ttfb, &transfer);
+        fprintf(fp, "%s\n      { \"symbol\": \"", i ? "," : "");
+        for (const unsigned char *c = (const unsigned char*)r->symbol; *c; c++) {
+            if (*c < JSON_MIN_UNESCAPED_CHAR) {
+                fprintf(fp, "\\u%04x", *c);
+            } else {
+                if (*c == '"' || *c == '\\') fputc('\\', fp);
+                fputc(*c, fp);
+            }
+        }
+        fprintf(fp, "\", \"status\": %ld, \"bytes\": %.0f, \"dns\": %.6f, \"connect\": %.6f, "
+                    "\"tls\": %.6f, \"ttfb\": %.6f, \"transfer\": %.6f, \"total\": %.6f, \"parse\": %.6f }",
+                r->http_status, r->bytes, dns, connect, tls, ttfb, transfer, r->total_secs, r->parse_secs);
+    }
+    fprintf(fp, "\n    ]\n  }\n}\n");
+}
+
+
+/* Aggregates only - per-symbol series would be unbounded in cardinality */
+static void write_prometheus(FILE *fp) {
+    double p50, p99, max;
+    double stages[5] = { 0 };
+    static const char *stage_names[] = { "dns", "connect", "tls", "ttfb", "transfer" };
+    double parse = 0, bytes = 0;
+    int ok = 0;
+
+    request_quantiles(&p50, &p99, &max);
+    for (int i = 0; i < M.request_count; i++) {
+        double s[5];
+        request_stages(&M.requests[i], &s[0], &s[1], &s[2], &s[3], &s[4]);
+        for (int j = 0; j < 5; j++) stages[j] += s[j];
+        parse += M.requests[i].parse_secs;
+        bytes += M.requests[i].bytes;
+        if (M.requests[i].http_status == 200) ok++;
+    }
+
+    fprintf(fp, "# HELP ibdq_phase_seconds Time spent in each phase of the last run.\n");
+    fprintf(fp, "# TYPE ibdq_phase_seconds gauge\n");
+    for (int i = 0; i < METRICS_PHASE_COUNT; i++) {
+        fprintf(fp, "ibdq_phase_seconds{phase=\"%s\"} %.6f\n", phase_names[i], M.phase_secs[i]);
+    }
+    fprintf(fp, "# HELP ibdq_sqlite_statement_seconds Time spent executing each SQLite statement.\n");
+    fprintf(fp, "# TYPE ibdq_sqlite_statement_seconds gauge\n");
+    for (int i = 0; i < METRICS_SQL_COUNT; i++) {
+        fprintf(fp, "ibdq_sqlite_statement_seconds{statement=\"%s\"} %.6f\n", sql_names[i], M.sql_secs[i]);
+    }
+    fprintf(fp, "# HELP ibdq_sqlite_statement_executions Number of executions of each SQLite statement.\n");
+    fprintf(fp, "# TYPE ibdq_sqlite_statement_executions gauge\n");
+    for (int i = 0; i < METRICS_SQL_COUNT; i++) {
+        fprintf(fp, "ibdq_sqlite_statement_executions{statement=\"%s\"} %ld\n", sql_names[i], M.sql_count[i]);
+    }
+    fprintf(fp, "# HELP ibdq_http_requests Number of HTTP requests completed.\n");
+    fprintf(fp, "# TYPE ibdq_http_requests gauge\n");
+    fprintf(fp, "ibdq_http_requests{outcome=\"ok\"} %d\n", ok);
+    fprintf(fp, "ibdq_http_requests{outcome=\"failed\"} %d\n", M.request_count - ok);
+    fprintf(fp, "# HELP ibdq_http_request_seconds HTTP request latency quantiles.\n");
+    fprintf(fp, "# TYPE ibdq_http_request_seconds gauge\n");
+    fprintf(fp, "ibdq_http_request_seconds{quantile=\"0.5\"} %.6f\n", p50);
+    fprintf(fp, "ibdq_http_request_seconds{quantile=\"0.99\"} %.6f\n", p99);
+    fprintf(fp, "ibdq_http_request_seconds{quantile=\"1\"} %.6f\n", max);
+    fprintf(fp, "# HELP ibdq_http_stage_seconds Time spent in each stage of all HTTP requests.\n");
+    fprintf(fp, "# TYPE ibdq_http_stage_seconds gauge\n");
+    for (int i = 0; i < 5; i++) {
+        fprintf(fp, "ibdq_http_stage_seconds{stage=\"%s\"} %.6f\n", stage_names[i], stages[i]);
+    }
+    fprintf(fp, "ibdq_http_stage_seconds{stage=\"parse\"} %.6f\n", parse);
+    fprintf(fp, "# HELP ibdq_http_received_bytes Bytes received in HTTP response bodies.\n");
+    fprintf(fp, "# TYPE ibdq_http_received_bytes gauge\n");
+    fprintf(fp, "ibdq_http_received_bytes %.0f\n", bytes);
+}
+
+
+int metrics_write(const char *path) {
+    size_t path_len = strlen(path);
+    size_t suffix_len = sizeof(PROMETHEUS_SUFFIX) - 1;
+    bool prometheus = path_len >= suffix_len && strcmp(path + path_len - suffix_len, PROMETHEUS_SUFFIX) == 0;
+    char *tmp_path = malloc(path_len + sizeof(TMP_SUFFIX));
+    FILE *fp;
+    int ret = -1;
+
+    /* Written to a temporary file, then renamed, so readers never see a partial report */
+    strcpy(tmp_path, path);
+    strcat(tmp_path, TMP_SUFFIX);
+    if ((fp = fopen(tmp_path, "w")) != NULL) {
+        if (prometheus) {
+            write_prometheus(fp);
+        } else {
+            write_json(fp);
+        }
+        if (fclose(fp) == 0 && rename(tmp_path, path) == 0) {
+            ret = 0;
+        } else {
+            remove(tmp_path);
+        }
+    }
+    free(tmp_path);
+
+    return ret;
+}
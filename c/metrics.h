@@ -0,0 +1,67 @@
+/**
+ * Timing instrumentation for ibdq.
+ *
+ * Collects per-phase, per-request and per-SQLite-statement timings, and
+ * writes them as a JSON or Prometheus text-format report.
+ *
+ * Timings may be recorded from any thread - requests by each download worker.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+
+/* Longest symbol reported in full, in bytes - at least as long as any ibdq accepts */
+#define METRICS_MAX_SYMBOL_LEN 255
+
+enum {
+    METRICS_PHASE_READ,
+    METRICS_PHASE_DOWNLOAD,
+    METRICS_PHASE_PERSIST,
+    METRICS_PHASE_COMMIT,
+    METRICS_PHASE_TOTAL,
+    METRICS_PHASE_COUNT
+};
+
+enum {
+    METRICS_SQL_SELECT_SECURITY,
+    METRICS_SQL_STAGE,
+    METRICS_SQL_MATCH,
+    METRICS_SQL_UPDATE,
+    METRICS_SQL_INSERT,
+    METRICS_SQL_UPDATE_PK,
+    METRICS_SQL_CLEAR,
+    METRICS_SQL_COMMIT,
+    METRICS_SQL_COUNT
+};
+
+typedef struct metrics_request {
+    const char *symbol;
+    long http_status;
+    double bytes;
+    /* Cumulative from the start of the request, as reported by libcurl */
+    double dns_secs;
+    double connect_secs;
+    double tls_secs;
+    double ttfb_secs;
+    double total_secs;
+    /* Time spent parsing the response */
+    double parse_secs;
+} metrics_request;
+
+void metrics_set_enabled(bool enable);
+bool metrics_enabled(void);
+double metrics_now(void);
+
+/* Discards everything recorded so far, e.g. at the start of each daemon refresh */
+void metrics_reset(void);
+
+void metrics_phase(int phase, double secs);
+void metrics_sql(int stmt, double secs);
+void metrics_request_done(const metrics_request *request);
+
+/* Prometheus text format when path ends with ".prom", JSON otherwise */
+int metrics_write(const char *path);
+
+#endif
@@ -0,0 +1,293 @@
+/**
+ * Table-driven parser for price histories in CSV - see price_csv.h.
+ */
+
+#include <string.h>
+
+#include "csv_scan.h"
+#include "price_csv.h"
+
+/* yyyy-mm-dd */
+#define ISO_DATE_LEN 10
+/* A response column not declared in PRICE_CSV_COLUMNS */
+#define UNDECLARED_COLUMN UINT8_MAX
+#define DATE_COLUMN 0
+
+typedef struct price_csv_column {
+    const char *name;
+    size_t name_len;
+    int type;
+    size_t offset;
+} price_csv_column;
+
+/* Generated from PRICE_CSV_COLUMNS - Date must be declared first */
+static const price_csv_column schema[] = {
+#define PRICE_CSV_SCHEMA_ENTRY(name, type, field) { name, sizeof(name) - 1, type, offsetof(price_row, field) },
+    PRICE_CSV_COLUMNS(PRICE_CSV_SCHEMA_ENTRY)
+#undef PRICE_CSV_SCHEMA_ENTRY
+};
+
+#define SCHEMA_LEN ((int)(sizeof(schema) / sizeof(schema[0])))
+#define ALL_CANDIDATES ((1u << SCHEMA_LEN) - 1)
+
+
+void price_csv_init(price_csv *csv) {
+    memset(csv, 0, sizeof(price_csv));
+    csv->state = PRICE_CSV_HEADER;
+    csv->candidates = ALL_CANDIDATES;
+}
+
+
+static bool has_date_column(const price_csv *csv) {
+    for (int i = 0; i < csv->column_count; i++) {
+        if (csv->plan[i].column == DATE_COLUMN) return true;
+    }
+
+    return false;
+}
+
+
+static int fail(price_csv *csv, const char *error, size_t i) {
+    csv->state = PRICE_CSV_FAILED;
+    csv->error = error;
+    csv->error_index = i;
+
+    return PRICE_CSV_ERROR;
+}
+
+
+/* Narrows the declared columns the name being read may match, a character at
+ * a time, resolving it at each delimiter into the plan of its column */
+static int parse_header(price_csv *csv, const char *body, size_t len, size_t *i) {
+    for (; *i < len; (*i)++) {
+        char c = body[*i];
+
+        if (c == ',' || c == '\n') {
+            price_csv_step *step = &csv->plan[csv->column_count];
+
+            if (csv->column_count == PRICE_CSV_MAX_COLUMNS) {
+                return fail(csv, "header (too many columns)", *i);
+            }
+            step->column = UNDECLARED_COLUMN;
+            step->type = PRICE_CSV_SKIP;
+            step->delim = c;
+            for (int j = 0; j < SCHEMA_LEN; j++) {
+                if ((csv->candidates & (1u << j)) && schema[j].name_len == (size_t)csv->offset) {
+                    step->column = (uint8_t)j;
+                    step->type = (uint8_t)schema[j].type;
+                    step->offset = (uint16_t)schema[j].offset;
+                }
+            }
+            csv->column_count++;
+            csv->candidates = ALL_CANDIDATES;
+            csv->offset = 0;
+            if (c == '\n') {
+                (*i)++;
+                if (!has_date_column(csv)) {
+                    return fail(csv, "header (no Date column)", *i - 1);
+                }
+                csv->state = PRICE_CSV_ROW;
+
+                return PRICE_CSV_MORE;
+            }
+        } else {
+            for (int j = 0; j < SCHEMA_LEN; j++) {
+                if ((size_t)csv->offset >= schema[j].name_len || schema[j].name[csv->offset] != c) {
+                    csv->candidates &= ~(1u << j);
+                }
+            }
+            csv->offset++;
+        }
+    }
+
+    return PRICE_CSV_MORE;
+}
+
+
+/* Reads digits into value, returning how many came before any other
+ * character - fields are short enough that they cannot wrap */
+static size_t parse_digits(const char *p, size_t len, uint64_t *value) {
+    uint64_t v = *value;
+    size_t i = 0;
+
+    for (; i < len; i++) {
+        unsigned digit = (unsigned char)p[i] - '0';
+
+        if (digit > 9) break;
+        v = v * 10 + digit;
+    }
+    *value = v;
+
+    return i;
+}
+
+
+/* yyyy-mm-dd, read directly when each part has its usual width */
+static bool parse_date(struct tm *date, const char *p, size_t len) {
+    uint64_t parts[3] = { 0 };
+    int part = 0;
+
+    if (len == ISO_DATE_LEN && p[4] == '-' && p[7] == '-') {
+        if (parse_digits(p, 4, &parts[0]) != 4 || parse_digits(p + 5, 2, &parts[1]) != 2 ||
+                parse_digits(p + 8, 2, &parts[2]) != 2) {
+            return false;
+        }
+        part = 2;
+    } else {
+        for (size_t i = 0; i < len; i++) {
+            i += parse_digits(p + i, len - i, &parts[part]);
+            if (i < len && (p[i] != '-' || part++ == 2)) {
+                return false;
+            }
+        }
+    }
+    date->tm_year = (int)parts[0] - 1900;
+    date->tm_mon = (int)parts[1] - 1;
+    date->tm_mday = (int)parts[2];
+
+    return part == 2;
+}
+
+
+/* Digits, optionally with a point among them */
+static bool parse_decimal(price_decimal *field, const char *p, size_t len) {
+    uint64_t units = 0;
+    size_t whole = parse_digits(p, len, &units), fraction = 0;
+
+    if (whole < len) {
+        fraction = len - whole - 1;
+        if (p[whole] != '.' || parse_digits(p + whole + 1, fraction, &units) != fraction) {
+            return false;
+        }
+    }
+    if (units > INT64_MAX) {
+        return false;
+    }
+    field->units = (int64_t)units;
+    field->scale = (int8_t)fraction;
+    field->point = whole < len;
+    field->present = len > 0;
+
+    return true;
+}
+
+
+static bool parse_integer(int64_t *field, const char *p, size_t len) {
+    uint64_t value = 0;
+
+    if (parse_digits(p, len, &value) != len || value > INT64_MAX) {
+        return false;
+    }
+    *field = (int64_t)value;
+
+    return true;
+}
+
+
+/* Parses a whole field, as its column's plan says */
+static bool parse_field(price_row *row, const price_csv_step *step, const char *p, size_t len) {
+    char *field = (char*)row + step->offset;
+
+    if (step->type == PRICE_CSV_SKIP) {
+        return true;
+    } else if (len > PRICE_CSV_MAX_NUM_LEN) {
+        return false;
+    } else if (step->type == PRICE_CSV_DECIMAL) {
+        return parse_decimal((price_decimal*)field, p, len);
+    } else if (step->type == PRICE_CSV_INTEGER) {
+        return parse_integer((int64_t*)field, p, len);
+    }
+
+    return parse_date((struct tm*)field, p, len);
+}
+
+
+/* Keeps the characters of a field split across chunks, until its delimiter -
+ * only whether there were any, for a skipped column */
+static bool carry_field(price_csv *csv, const price_csv_step *step, const char *p, size_t len) {
+    if (step->type == PRICE_CSV_SKIP) {
+        csv->offset = csv->offset > 0 || len > 0;
+    } else if ((size_t)csv->offset + len > PRICE_CSV_MAX_NUM_LEN) {
+        return false;
+    } else {
+        memcpy(csv->field + csv->offset, p, len);
+        csv->offset += (int)len;
+    }
+
+    return true;
+}
+
+
+static const char *column_name(const price_csv_step *step) {
+    return step->column == UNDECLARED_COLUMN ? "column" : schema[step->column].name;
+}
+
+
+int price_csv_parse(price_csv *csv, const char *body, size_t len, price_csv_row_fn on_row, void *ctx) {
+    const char *p, *end = body + len;
+    size_t i = 0;
+
+    if (csv->state == PRICE_CSV_HEADER && parse_header(csv, body, len, &i) == PRICE_CSV_ERROR) {
+        return PRICE_CSV_ERROR;
+    }
+    if (csv->state != PRICE_CSV_ROW) {
+        return csv->state == PRICE_CSV_FAILED ? PRICE_CSV_ERROR : PRICE_CSV_MORE;
+    }
+    for (p = body + i; p < end; ) {
+        const price_csv_step *step = &csv->plan[csv->column];
+        const char *delim = csv_scan_delim(p, end);
+        const char *field = p;
+        size_t field_len = (size_t)(delim - p);
+
+        /* Split across chunks - parsed from the characters carried over */
+        if (csv->offset > 0 || delim == end) {
+            if (!carry_field(csv, step, p, field_len)) {
+                return fail(csv, column_name(step), (size_t)(delim - body));
+            }
+            if (delim == end) {
+                break;
+            }
+            field = csv->field;
+            field_len = (size_t)csv->offset;
+        }
+        if (*delim != step->delim || !parse_field(&csv->row, step, field, field_len)) {
+            return fail(csv, column_name(step), (size_t)(delim - body));
+        }
+        p = delim + 1;
+        csv->offset = 0;
+        if (++csv->column < csv->column_count) {
+            continue;
+        }
+        csv->column = 0;
+        if (!on_row(ctx, &csv->row)) {
+            return PRICE_CSV_STOPPED;
+        }
+        memset(&csv->row, 0, sizeof(price_row));
+    }
+
+    return PRICE_CSV_MORE;
+}
+
+
+bool price_csv_finish(price_csv *csv, price_csv_row_fn on_row, void *ctx) {
+    const price_csv_step *step;
+
+    if (csv->state != PRICE_CSV_ROW) {
+        return false;
+    }
+    if (csv->column == 0 && csv->offset == 0) {
+        return true;
+    }
+    if (csv->column < csv->column_count - 1) {
+        return false;
+    }
+    step = &csv->plan[csv->column];
+    if (!parse_field(&csv->row, step, csv->field, (size_t)csv->offset)) {
+        return false;
+    }
+    csv->column = 0;
+    csv->offset = 0;
+    on_row(ctx, &csv->row);
+
+    return true;
+}
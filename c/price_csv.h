@@ -0,0 +1,126 @@
+/**
+ * Table-driven parser for price histories in CSV, for ibdq.
+ *
+ * Columns are declared once, in PRICE_CSV_COLUMNS, and resolved by name from
+ * the header row of each response, so they may come in any order. Columns not
+ * declared (e.g. Adj Close, Dividends) are skipped, and declared columns
+ * missing from a response are left empty - except Date, which is required.
+ * Input may be split into chunks at any byte.
+ *
+ * The header is resolved once into a plan of each column's type, field and
+ * delimiter. Rows are then parsed a field at a time, each from the span up to
+ * the delimiter found by csv_scan - a field split across chunks is copied
+ * until its delimiter arrives.
+ */
+
+#ifndef PRICE_CSV_H
+#define PRICE_CSV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PRICE_CSV_MAX_COLUMNS 16
+/* Longest field parsed, in characters, including the point of a price */
+#define PRICE_CSV_MAX_NUM_LEN 19
+
+/* Exact decimal, as downloaded - units / 10^scale */
+typedef struct price_decimal {
+    int64_t units;
+    int8_t scale;
+    bool point;
+    /* Has at least one character - empty fields are stored as NULL */
+    bool present;
+} price_decimal;
+
+typedef struct price_row {
+    struct tm date;
+    price_decimal open;
+    price_decimal high;
+    price_decimal low;
+    price_decimal close;
+    int64_t volume;
+} price_row;
+
+enum {
+    PRICE_CSV_DATE,
+    PRICE_CSV_DECIMAL,
+    PRICE_CSV_INTEGER,
+    /* Columns not declared */
+    PRICE_CSV_SKIP
+};
+
+/* COLUMN(header name, type, price_row field) */
+#define PRICE_CSV_COLUMNS(COLUMN) \
+    COLUMN("Date", PRICE_CSV_DATE, date) \
+    COLUMN("Open", PRICE_CSV_DECIMAL, open) \
+    COLUMN("High", PRICE_CSV_DECIMAL, high) \
+    COLUMN("Low", PRICE_CSV_DECIMAL, low) \
+    COLUMN("Close", PRICE_CSV_DECIMAL, close) \
+    COLUMN("Volume", PRICE_CSV_INTEGER, volume)
+
+enum {
+    PRICE_CSV_HEADER,
+    PRICE_CSV_ROW,
+    PRICE_CSV_FAILED
+};
+
+/* Results of price_csv_parse */
+enum {
+    PRICE_CSV_MORE,
+    PRICE_CSV_STOPPED,
+    PRICE_CSV_ERROR
+};
+
+/* How a column of the response is parsed, resolved from the header */
+typedef struct price_csv_step {
+    /* Declared column, or UINT8_MAX if skipped */
+    uint8_t column;
+    uint8_t type;
+    /* Delimiter ending the field - '\n' for the last column */
+    char delim;
+    /* Offset of its field in price_row */
+    uint16_t offset;
+} price_csv_step;
+
+/* Position of the parser, kept across chunks */
+typedef struct price_csv {
+    int state;
+    /* Each column of the response, in order */
+    price_csv_step plan[PRICE_CSV_MAX_COLUMNS];
+    int column_count;
+    int column;
+    /* Characters of the current field read from earlier chunks, or of the header name */
+    int offset;
+    /* Those characters, unless the column is skipped */
+    char field[PRICE_CSV_MAX_NUM_LEN];
+    /* Header - declared columns the current name may still match */
+    uint32_t candidates;
+    price_row row;
+    /* What failed to parse, and where in the chunk */
+    const char *error;
+    size_t error_index;
+} price_csv;
+
+/* Receives each complete row, returning false to stop parsing */
+typedef bool (*price_csv_row_fn)(void *ctx, price_row *row);
+
+void price_csv_init(price_csv *csv);
+
+/*
+ * Parses a chunk, handing each complete row to on_row, and clearing it for
+ * the next row unless on_row returns false - PRICE_CSV_STOPPED then leaves
+ * the row as parsed. Returns PRICE_CSV_ERROR, with error and error_index
+ * set, if the chunk does not match the header, or the schema.
+ */
+int price_csv_parse(price_csv *csv, const char *body, size_t len, price_csv_row_fn on_row, void *ctx);
+
+/*
+ * Ends the input - hands the final row to on_row, if it was complete but
+ * without a trailing newline. Returns true unless input ended in the header,
+ * or partway through a row.
+ */
+bool price_csv_finish(price_csv *csv, price_csv_row_fn on_row, void *ctx);
+
+#endif
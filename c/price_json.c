@@ -0,0 +1,337 @@
+/**
+ * Streaming parser for batches of latest prices in JSON - see price_json.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "price_json.h"
+
+#define MAX_DECIMAL_UNITS ((INT64_MAX - 9) / 10)
+/* Largest scale bound as a price - see POWERS_OF_TEN in main.c */
+#define MAX_DECIMAL_SCALE 19
+#define MILLIS_PER_SEC 1000
+
+typedef struct price_json_field {
+    const char *key;
+    int type;
+    size_t offset;
+} price_json_field;
+
+/* Generated from PRICE_JSON_FIELDS */
+static const price_json_field schema[] = {
+#define PRICE_JSON_SCHEMA_ENTRY(key, type, field) { key, type, offsetof(price_row, field) },
+    PRICE_JSON_FIELDS(PRICE_JSON_SCHEMA_ENTRY)
+#undef PRICE_JSON_SCHEMA_ENTRY
+};
+
+#define SCHEMA_LEN ((int)(sizeof(schema) / sizeof(schema[0])))
+
+
+void price_json_init(price_json *json) {
+    memset(json, 0, sizeof(price_json));
+}
+
+
+static int fail(price_json *json, const char *error, size_t i) {
+    json->failed = true;
+    json->error = error;
+    json->error_index = i;
+
+    return PRICE_JSON_ERROR;
+}
+
+
+static bool in_object(const price_json *json) {
+    return json->depth > 0 && (json->objects & (1u << (json->depth - 1)));
+}
+
+
+/* Parses a number, or a string holding one, as an exact decimal - digits
+ * beyond the precision of a price are dropped */
+static bool parse_decimal(const char *text, price_decimal *decimal) {
+    const char *p = text;
+    bool negative = *p == '-';
+    int scale;
+
+    memset(decimal, 0, sizeof(price_decimal));
+    if (negative) p++;
+    for (; *p; p++) {
+        if (*p >= '0' && *p <= '9') {
+            if (decimal->units <= MAX_DECIMAL_UNITS) {
+                decimal->units = decimal->units * 10 + *p - '0';
+                if (decimal->point) decimal->scale++;
+            } else if (!decimal->point) {
+                return false;
+            }
+            decimal->present = true;
+        } else if (*p == '.' && !decimal->point) {
+            decimal->point = true;
+        } else {
+            break;
+        }
+    }
+    scale = decimal->scale;
+    if (*p == 'e' || *p == 'E') {
+        char *end;
+        long exponent = strtol(p + 1, &end, 10);
+        if (end == p + 1 || exponent > MAX_DECIMAL_SCALE || exponent < -MAX_DECIMAL_SCALE) {
+            return false;
+        }
+        scale -= (int)exponent;
+        p = end;
+    }
+    if (*p != '\0' || !decimal->present) {
+        return false;
+    }
+    for (; scale < 0; scale++) {
+        if (decimal->units > MAX_DECIMAL_UNITS) return false;
+        decimal->units *= 10;
+    }
+    for (; scale > MAX_DECIMAL_SCALE; scale--) {
+        decimal->units /= 10;
+    }
+    decimal->scale = (int8_t)scale;
+    if (negative) decimal->units = -decimal->units;
+
+    return true;
+}
+
+
+/* Dates are days - sent as midnight UTC, or as yyyy-mm-dd */
+static bool parse_date(const char *text, bool string, struct tm *date) {
+    price_decimal millis;
+    int year, mon, mday;
+
+    memset(date, 0, sizeof(struct tm));
+    if (string && strchr(text, '-') != NULL) {
+        char end;
+        if (sscanf(text, "%4d-%2d-%2d%c", &year, &mon, &mday, &end) != 3) {
+            return false;
+        }
+    } else {
+        time_t secs;
+        struct tm utc;
+
+        if (!parse_decimal(text, &millis)) {
+            return false;
+        }
+        secs = (time_t)(millis.units / MILLIS_PER_SEC);
+        for (int i = 0; i < millis.scale; i++) secs /= 10;
+        if (gmtime_r(&secs, &utc) == NULL) {
+            return false;
+        }
+        year = utc.tm_year + 1900;
+        mon = utc.tm_mon + 1;
+        mday = utc.tm_mday;
+    }
+    date->tm_year = year - 1900;
+    date->tm_mon = mon - 1;
+    date->tm_mday = mday;
+
+    return true;
+}
+
+
+/* Stores a value of the price being parsed, if its key is declared */
+static void set_field(price_json *json, bool string) {
+    for (int j = 0; j < SCHEMA_LEN; j++) {
+        if (strcasecmp(json->key, schema[j].key) != 0) {
+            continue;
+        }
+        char *field = (char*)&json->row + schema[j].offset;
+        price_decimal decimal;
+
+        if (schema[j].type == PRICE_JSON_DATE) {
+            json->dated = parse_date(json->token, string, (struct tm*)field);
+        } else if (parse_decimal(json->token, &decimal)) {
+            if (schema[j].type == PRICE_JSON_DECIMAL) {
+                *(price_decimal*)field = decimal;
+            } else {
+                int64_t units = decimal.units;
+                for (int k = 0; k < decimal.scale; k++) units /= 10;
+                *(int64_t*)field = units;
+            }
+        }
+        break;
+    }
+}
+
+
+/* A string, number or literal has been read */
+static void end_scalar(price_json *json, bool string) {
+    json->token[json->token_len] = '\0';
+    if (string && in_object(json) && json->expect_key) {
+        memcpy(json->key, json->token, json->token_len + 1);
+        json->key_truncated = json->token_truncated;
+    } else if (json->price_depth > 0 && json->depth == json->price_depth && !json->token_truncated) {
+        set_field(json, string);
+    }
+    json->token_len = 0;
+    json->token_truncated = false;
+    if (json->depth == 0) json->complete = true;
+}
+
+
+static void append_token(price_json *json, const char *chars, size_t len) {
+    size_t room = PRICE_JSON_MAX_TOKEN_LEN - json->token_len;
+
+    if (len > room) {
+        len = room;
+        json->token_truncated = true;
+    }
+    memcpy(json->token + json->token_len, chars, len);
+    json->token_len += (int)len;
+}
+
+
+static bool open_container(price_json *json, bool object) {
+    /* The key naming this container, if in an object */
+    const char *key = in_object(json) ? json->key : NULL;
+
+    if (json->depth == PRICE_JSON_MAX_DEPTH) {
+        return false;
+    }
+    if (object && key && json->prices_depth == 0 && json->depth == 1 && strcasecmp(key, PRICE_JSON_PRICES_KEY) == 0) {
+        json->prices_depth = json->depth + 1;
+    } else if (object && key && json->prices_depth > 0 && json->depth == json->prices_depth) {
+        memcpy(json->symbol, json->key, sizeof(json->symbol));
+        json->symbol_truncated = json->key_truncated;
+        json->price_depth = json->depth + 1;
+        json->dated = false;
+        memset(&json->row, 0, sizeof(price_row));
+    }
+    if (object) {
+        json->objects |= 1u << json->depth;
+    } else {
+        json->objects &= ~(1u << json->depth);
+    }
+    json->depth++;
+    json->expect_key = object;
+
+    return true;
+}
+
+
+/* Returns false if on_row asked to stop */
+static bool close_container(price_json *json, price_json_row_fn on_row, void *ctx) {
+    bool more = true;
+
+    if (json->depth == json->price_depth) {
+        json->price_depth = 0;
+        if (json->dated && !json->symbol_truncated) {
+            more = on_row(ctx, json->symbol, &json->row);
+        }
+    } else if (json->depth == json->prices_depth) {
+        json->prices_depth = 0;
+    }
+    json->depth--;
+    json->expect_key = false;
+    if (json->depth == 0) json->complete = true;
+
+    return more;
+}
+
+
+static bool is_scalar_char(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           c == '.' || c == '-' || c == '+';
+}
+
+
+int price_json_parse(price_json *json, const char *body, size_t len, price_json_row_fn on_row, void *ctx) {
+    if (json->failed) {
+        return PRICE_JSON_ERROR;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = body[i];
+
+        if (json->in_string) {
+            if (json->escaped) {
+                append_token(json, &c, 1);
+                json->escaped = false;
+            } else if (c == '\\') {
+                json->escaped = true;
+            } else if (c == '"') {
+                json->in_string = false;
+                end_scalar(json, true);
+            } else {
+                /* Copies up to the next quote or escape in bulk */
+                size_t span = 1;
+                while (i + span < len && body[i + span] != '"' && body[i + span] != '\\') span++;
+                append_token(json, body + i, span);
+                i += span - 1;
+            }
+            continue;
+        }
+        if (json->in_scalar) {
+            if (is_scalar_char(c)) {
+                append_token(json, &c, 1);
+                continue;
+            }
+            json->in_scalar = false;
+            end_scalar(json, false);
+        }
+        if (json->complete && c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+            return fail(json, "trailing data", i);
+        }
+        switch (c) {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+                break;
+            case '{':
+            case '[':
+                if (!open_container(json, c == '{')) {
+                    return fail(json, "nesting", i);
+                }
+                break;
+            case '}':
+            case ']':
+                if (json->depth == 0 || in_object(json) != (c == '}')) {
+                    return fail(json, "closing bracket", i);
+                }
+                if (!close_container(json, on_row, ctx)) {
+                    return PRICE_JSON_STOPPED;
+                }
+                break;
+            case ':':
+                if (!in_object(json) || !json->expect_key) {
+                    return fail(json, "colon", i);
+                }
+                json->expect_key = false;
+                break;
+            case ',':
+                if (json->depth == 0) {
+                    return fail(json, "comma", i);
+                }
+                json->expect_key = in_object(json);
+                break;
+            case '"':
+                json->in_string = true;
+                break;
+            default:
+                if (!is_scalar_char(c) || (in_object(json) && json->expect_key)) {
+                    return fail(json, "value", i);
+                }
+                json->in_scalar = true;
+                append_token(json, &c, 1);
+        }
+    }
+
+    return PRICE_JSON_MORE;
+}
+
+
+bool price_json_finish(price_json *json) {
+    if (json->in_scalar) {
+        json->in_scalar = false;
+        end_scalar(json, false);
+    }
+
+    return !json->failed && json->complete;
+}
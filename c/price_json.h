@@ -0,0 +1,104 @@
+/**
+ * Streaming parser for batches of latest prices in JSON, for ibdq.
+ *
+ * Parses responses of the quote API used by the other implementations, which
+ * takes a comma-separated list of symbols, and returns the latest price of
+ * each, keyed by symbol:
+ *
+ *   {"bySymbol": {"AAPL": {"millisSinceEpoch": 1696204800000, "open": 171.22,
+ *     "high": 174.3, "low": 170.93, "close": 173.75, "volume": 52164500}, ...}}
+ *
+ * Fields are declared once, in PRICE_JSON_FIELDS, and matched ignoring case.
+ * Prices may also be strings, and dates yyyy-mm-dd strings. Anything else is
+ * skipped. Input may be split into chunks at any byte.
+ */
+
+#ifndef PRICE_JSON_H
+#define PRICE_JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "price_csv.h"
+
+/* Longest symbol, or other key or value, kept - longer ones are skipped */
+#define PRICE_JSON_MAX_TOKEN_LEN 63
+/* Deepest nesting of objects and arrays */
+#define PRICE_JSON_MAX_DEPTH 32
+
+enum {
+    /* Milliseconds since the Unix epoch, or a yyyy-mm-dd string */
+    PRICE_JSON_DATE,
+    PRICE_JSON_DECIMAL,
+    PRICE_JSON_INTEGER
+};
+
+/* FIELD(key, type, price_row field) */
+#define PRICE_JSON_FIELDS(FIELD) \
+    FIELD("millisSinceEpoch", PRICE_JSON_DATE, date) \
+    FIELD("date", PRICE_JSON_DATE, date) \
+    FIELD("open", PRICE_JSON_DECIMAL, open) \
+    FIELD("high", PRICE_JSON_DECIMAL, high) \
+    FIELD("low", PRICE_JSON_DECIMAL, low) \
+    FIELD("close", PRICE_JSON_DECIMAL, close) \
+    FIELD("volume", PRICE_JSON_INTEGER, volume)
+
+/* Object holding the prices, keyed by symbol */
+#define PRICE_JSON_PRICES_KEY "bySymbol"
+
+/* Results of price_json_parse */
+enum {
+    PRICE_JSON_MORE,
+    PRICE_JSON_STOPPED,
+    PRICE_JSON_ERROR
+};
+
+/* Position of the parser, kept across chunks */
+typedef struct price_json {
+    bool failed;
+    /* Kind of each open container - bit set for objects */
+    uint32_t objects;
+    int depth;
+    /* Depths of the object holding prices, and of the price being parsed, or 0 */
+    int prices_depth;
+    int price_depth;
+    /* Objects expect a key next, after { and , */
+    bool expect_key;
+    bool in_string;
+    bool escaped;
+    /* Number or literal being read */
+    bool in_scalar;
+    char token[PRICE_JSON_MAX_TOKEN_LEN + 1];
+    int token_len;
+    bool token_truncated;
+    /* Latest key, and the symbol of the price being parsed */
+    char key[PRICE_JSON_MAX_TOKEN_LEN + 1];
+    bool key_truncated;
+    char symbol[PRICE_JSON_MAX_TOKEN_LEN + 1];
+    bool symbol_truncated;
+    /* Has a date */
+    bool dated;
+    price_row row;
+    /* A whole document has been read */
+    bool complete;
+    /* What failed to parse, and where in the chunk */
+    const char *error;
+    size_t error_index;
+} price_json;
+
+/* Receives each price with a date, returning false to stop parsing */
+typedef bool (*price_json_row_fn)(void *ctx, const char *symbol, price_row *row);
+
+void price_json_init(price_json *json);
+
+/*
+ * Parses a chunk, handing each price to on_row as its object closes. Returns
+ * PRICE_JSON_ERROR, with error and error_index set, if the chunk is not JSON.
+ */
+int price_json_parse(price_json *json, const char *body, size_t len, price_json_row_fn on_row, void *ctx);
+
+/* Ends the input - returns true if it was a complete JSON document */
+bool price_json_finish(price_json *json);
+
+#endif
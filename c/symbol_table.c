@@ -0,0 +1,122 @@
+/**
+ * String interning table for ibdq - see symbol_table.h.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symbol_table.h"
+
+/* Room for a few thousand symbols and ids per block - longer strings get a block of their own */
+#define SYMBOL_BLOCK_SIZE 65536
+#define SYMBOL_TABLE_INITIAL_SLOTS 1024
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct symbol_block {
+    struct symbol_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+} symbol_block;
+
+
+/* FNV-1a */
+static uint64_t hash_string(const char *str, size_t len) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)str[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+
+/* Slot holding str, or the empty slot where it belongs */
+static const char **find_slot(const char **slots, size_t slot_count, const char *str, size_t len) {
+    size_t mask = slot_count - 1;
+    size_t i = (size_t)hash_string(str, len) & mask;
+
+    while (slots[i] != NULL && (strncmp(slots[i], str, len) != 0 || slots[i][len] != '\0')) {
+        i = (i + 1) & mask;
+    }
+
+    return &slots[i];
+}
+
+
+static int grow_slots(symbol_table *table) {
+    size_t slot_count = table->slot_count ? table->slot_count * 2 : SYMBOL_TABLE_INITIAL_SLOTS;
+    const char **slots = calloc(slot_count, sizeof(const char*));
+
+    if (slots == NULL) return -1;
+    for (size_t i = 0; i < table->slot_count; i++) {
+        const char *str = table->slots[i];
+        if (str != NULL) *find_slot(slots, slot_count, str, strlen(str)) = str;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->slot_count = slot_count;
+
+    return 0;
+}
+
+
+/* Copies str into the current block, or a new one when it does not fit */
+static const char *store_string(symbol_table *table, const char *str, size_t len) {
+    symbol_block *block = table->blocks;
+    char *copy;
+
+    if (block == NULL || block->size - block->used < len + 1) {
+        size_t size = len + 1 > SYMBOL_BLOCK_SIZE ? len + 1 : SYMBOL_BLOCK_SIZE;
+
+        block = malloc(sizeof(symbol_block) + size);
+        if (block == NULL) return NULL;
+        block->next = table->blocks;
+        block->used = 0;
+        block->size = size;
+        table->blocks = block;
+    }
+    copy = block->data + block->used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    block->used += len + 1;
+
+    return copy;
+}
+
+
+void symbol_table_init(symbol_table *table) {
+    memset(table, 0, sizeof(symbol_table));
+}
+
+
+void symbol_table_free(symbol_table *table) {
+    while (table->blocks != NULL) {
+        symbol_block *next = table->blocks->next;
+        free(table->blocks);
+        table->blocks = next;
+    }
+    free(table->slots);
+    symbol_table_init(table);
+}
+
+
+const char *symbol_table_intern(symbol_table *table, const char *str) {
+    size_t len = strlen(str);
+    const char **slot;
+
+    if ((table->count + 1) * 2 > table->slot_count && grow_slots(table) != 0) {
+        return NULL;
+    }
+    slot = find_slot(table->slots, table->slot_count, str, len);
+    if (*slot == NULL) {
+        *slot = store_string(table, str, len);
+        if (*slot == NULL) return NULL;
+        table->count++;
+    }
+
+    return *slot;
+}
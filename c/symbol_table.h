@@ -0,0 +1,34 @@
+/**
+ * String interning table for the symbols and security ids of ibdq.
+ *
+ * Each distinct string is stored once, NUL-terminated, in blocks allocated as
+ * the table grows, and found again through an open-addressed hash index.
+ * Interned strings never move, so records may keep pointers to them, and two
+ * records share a string exactly when their pointers are equal.
+ *
+ * Not thread-safe - strings are interned while securities are read, and only
+ * read afterwards.
+ */
+
+#ifndef SYMBOL_TABLE_H
+#define SYMBOL_TABLE_H
+
+#include <stddef.h>
+
+typedef struct symbol_table {
+    /* Chain of blocks, most recently allocated first */
+    struct symbol_block *blocks;
+    /* Hash index of the interned strings - a power of two slots, at most half full */
+    const char **slots;
+    size_t slot_count;
+    size_t count;
+} symbol_table;
+
+void symbol_table_init(symbol_table *table);
+/* Frees every string, invalidating pointers to them */
+void symbol_table_free(symbol_table *table);
+
+/* Returns the interned copy of str, or NULL should allocation fail */
+const char *symbol_table_intern(symbol_table *table, const char *str);
+
+#endif